@@ -42,12 +42,22 @@
 //NOTE: COMPLIER MUST support C++11!
 
 #include <CGAL/Exact_predicates_exact_constructions_kernel.h>
+#include <CGAL/Exact_predicates_inexact_constructions_kernel.h>
 #include <CGAL/Polyhedron_3.h>
 #include <CGAL/Surface_mesh.h>
 #include <CGAL/Nef_polyhedron_3.h>
 #include <CGAL/boost/graph/convert_nef_polyhedron_to_polygon_mesh.h>
+#include <CGAL/convert_nef_polyhedron_to_polygon_soup.h>
 #include <CGAL/convex_hull_3.h>
 #include <CGAL/IO/Color.h>
+#include <CGAL/Polygon_mesh_processing/corefinement.h>
+#include <CGAL/Polygon_mesh_processing/transform.h>
+#include <CGAL/Polygon_mesh_processing/bbox.h>
+#include <CGAL/Polygon_mesh_processing/polygon_soup_to_polygon_mesh.h>
+#include <CGAL/Polygon_2.h>
+#include <CGAL/Polygon_with_holes_2.h>
+#include <CGAL/Polygon_set_2.h>
+#include <CGAL/Polygon_triangulation_decomposition_2.h>
 #include <iostream>
 #include <sstream>
 #include <fstream>
@@ -58,6 +68,35 @@
 #include <ctime>
 #include <fstream>
 #include <stdlib.h>
+#include <memory>
+#include <map>
+#include <list>
+#include <set>
+#include <unordered_map>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <algorithm>
+#include <chrono>
+#include <array>
+#include <tuple>
+#include <cstdio>
+#include <cmath>
+#include <iterator>
+#include <cstring>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <utime.h>
+#endif
 
 typedef CGAL::Exact_predicates_exact_constructions_kernel Exact_kernel;
 typedef CGAL::Polyhedron_3<Exact_kernel> Polyhedron;
@@ -70,6 +109,28 @@ typedef Nef_polyhedron::Aff_transformation_3  Aff_transformation_3;
 typedef Polyhedron::Halfedge_handle Halfedge_handle;
 typedef Exact_kernel::Point_3 Point_3;
 
+//These are used by the fast backend, which runs the same grammar on an inexact (double) kernel.
+typedef CGAL::Exact_predicates_inexact_constructions_kernel Fast_kernel;
+typedef CGAL::Surface_mesh<Fast_kernel::Point_3> Fast_mesh;
+
+//A Fast_solid is the fast backend's counterpart to a Nef_polyhedron. It is a list of closed
+//triangle meshes, where parts whose bounding boxes don't overlap are kept as separate meshes
+//instead of being merged, so only intersecting parts ever need a Boolean operation.
+struct Fast_solid{
+    typedef Fast_kernel::Vector_3 Vector_3;
+    typedef Fast_kernel::Aff_transformation_3 Aff_transformation_3;
+    
+    std::vector<Fast_mesh> parts;
+    
+    void transform(const Aff_transformation_3& transformation){
+        for(std::size_t i = 0; i<parts.size(); i++)
+            CGAL::Polygon_mesh_processing::transform(transformation, parts[i]);
+    }
+    bool is_empty() const{
+        return parts.empty();
+    }
+};
+
 //------------------------------GLOBAL VARIABLES--------------------------
 
 
@@ -77,130 +138,1533 @@ typedef Exact_kernel::Point_3 Point_3;
 //Then everytime a new cube or cylinder is created, it copies the cube/cylinder from the variable
 //below. This reduces the total time it takes to generate a mesh.
 
-Polyhedron poly_org;
 Nef_polyhedron nef_org;
 double poly_org_width = 10;
 Nef_polyhedron cylinder_org;
+Fast_solid fast_cube_org; //The fast backend's copies of the cube/cylinder.
+Fast_solid fast_cylinder_org;
 int fn = 20; //This is used for the amount of sides of the cylinder.
-std::string file_name;
-const double PI  =3.141592;
+const double PI  =3.14159265358979323846;
+bool instancing = false; //If true, window tiles are placed as instances instead of being unioned (--instancing).
+bool fast_backend = false; //If true, the building is generated with the fast backend (--fast).
+bool csg = false; //If true, the exact backend builds a CSG tree which is optimized before it is evaluated (--csg).
+bool eager_transforms = false; //If true, the exact backend transforms each Nef right away instead of lazily (--eager-transforms).
+bool facade_2d = false; //If true, each facade is laid out as 2D polygons and extruded in layers of depth (--facade-2d).
+bool lod_output = false; //If true, the building is written at each level of detail, from 0 to 3 (--lod).
+int lod_fn = 8; //The amount of sides of the cylinders at level of detail 2.
+bool chain_unions = false; //If true, parts are unioned left to right instead of as a balanced tree (--chain-unions).
+bool prototype_caching = true; //If false, windows/doors/railings are always regenerated (--no-prototype-cache).
+double triangle_budget = 0; //If set, buildings estimated to have more triangles are skipped (--triangle-budget).
+double snap_grid = 0; //If set, dimensions and transformations are rounded to 1/snap_grid of a unit (--snap).
+double cache_quantum = 1024; //The prototype cache keys dimensions to 1/cache_quantum of a unit.
+std::size_t prototype_cache_limit = 4096; //The amount of prototypes kept by each backend's cache, past which the least recently used are removed (--prototype-cache-size).
+std::atomic<long> prototype_cache_hits(0);
+std::atomic<long> prototype_cache_misses(0);
+std::atomic<long> prototype_cache_evictions(0);
+std::string mesh_format = "off"; //The format of the output mesh file: off, ply, stl, glb or obj (--format).
+bool optimize_mesh = false; //If true, the vertices are welded and coplanar faces merged before writing (--optimize-mesh).
+double weld_tolerance = 1e-6; //Vertices closer than this are welded, and planes closer than this are the same.
+bool stream_output = false; //If true, each facade and the shell are written to an .OBJ file as they are generated (--stream).
+std::string mesh_cache_dir; //If set, the meshes are cached in this directory under a hash of their parameters (--mesh-cache).
+double mesh_cache_limit = 1024; //The size of the mesh cache in megabytes, past which the least recently used are removed (--mesh-cache-size).
+bool profiling = false; //If true, each stage is timed and the stats are printed at the end (--profile).
+std::string trace_file; //If set, the timed stages are also written to this file as Chrome trace events (--trace).
+unsigned int thread_count = 1; //The amount of threads used to generate the facades (--threads, 0 uses every core).
+int log_level = 1; //How much progress is printed: 0 is quiet, 1 a summary of each building and 2 every tile (--log).
 
 //------------------------------HELPER FUNCTIONS-------------------------
 
+//Each building has its own random number generator, seeded from the command line or the parameter file.
+//It is counter-based: the nth number is a hash (SplitMix64) of the seed and n, so a building always gets
+//the same numbers for its seed, no matter how many threads or other buildings are being generated.
+class Random{
+public:
+    Random(unsigned long long seed) : seed(seed), counter(0){}
+    
+    unsigned long long next(){
+        unsigned long long z = seed+(++counter)*0x9E3779B97F4A7C15ULL;
+        z = (z^(z>>30))*0xBF58476D1CE4E5B9ULL;
+        z = (z^(z>>27))*0x94D049BB133111EBULL;
+        return z^(z>>31);
+    }
+    
+    //This returns a double from 0 to 1 (not including 1).
+    double uniform(){
+        return (next()>>11)*(1.0/9007199254740992.0);
+    }
+    
+private:
+    unsigned long long seed;
+    unsigned long long counter;
+};
+
 //Below are the two random functions. These are used to generate a random number
-//from min-max, and can either be a double or an integer.
-double randDNum(double min, double max){
-    double rand_num =fmod(rand(), (max - min + 1)) + min;
+//from min-max, and can either be a double in [min, max) or an integer (including max).
+double randDNum(Random& random, double min, double max){
+    double rand_num = min+random.uniform()*(max-min);
     return rand_num;
 }
 
-int randINum(int min, int max){
-    int rand_num = randDNum(min, max);
+int randINum(Random& random, int min, int max){
+    if(max<=min) return min;
+    int rand_num = min+random.next()%(max-min+1);
     return rand_num;
 }
 
+//------------------------------TASK POOL--------------------------
+
+//The Task_pool runs tasks on a set of worker threads. Each worker has its own queue, taking tasks
+//from the back of its own queue and stealing from the front of the others' when it runs out.
+//A thread waiting on a Task_group runs queued tasks while it waits, so a task can start and wait
+//on its own subtasks (e.g. a side generating its rows) without blocking a worker.
+//Note: The exact backend requires CGAL to be built with thread support (CGAL_HAS_THREADS),
+//which is the default.
+class Task_pool{
+public:
+    explicit Task_pool(unsigned int thread_count) : queues(thread_count), stopping(false), queued(0), next_queue(0){
+        for(unsigned int i = 0; i<thread_count; i++)
+            queue_locks.push_back(std::unique_ptr<std::mutex>(new std::mutex()));
+        for(unsigned int i = 0; i<thread_count; i++)
+            workers.push_back(std::thread(&Task_pool::worker_loop, this, i));
+    }
+    
+    ~Task_pool(){
+        {
+            std::lock_guard<std::mutex> lock(sleep_lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for(std::size_t i = 0; i<workers.size(); i++)
+            workers[i].join();
+    }
+    
+    //Tasks submitted by a worker go onto its own queue, the rest are spread over the queues.
+    void submit(std::function<void()> task){
+        std::size_t index = (current_pool==this) ? current_worker : next_queue++ % queues.size();
+        {
+            std::lock_guard<std::mutex> lock(*queue_locks[index]);
+            queues[index].push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(sleep_lock);
+            queued++;
+        }
+        wake.notify_one();
+    }
+    
+    //Runs one queued task on the calling thread. Returns false if there were none.
+    bool run_pending_task(){
+        std::function<void()> task;
+        if(!take_task(task)) return false;
+        task();
+        return true;
+    }
+    
+private:
+    bool take_task(std::function<void()>& task){
+        std::size_t own = (current_pool==this) ? current_worker : 0;
+        
+        if(current_pool==this){
+            std::lock_guard<std::mutex> lock(*queue_locks[own]);
+            if(!queues[own].empty()){
+                task = std::move(queues[own].back());
+                queues[own].pop_back();
+                queued--;
+                return true;
+            }
+        }
+        for(std::size_t i = 0; i<queues.size(); i++){
+            std::size_t index = (own+i) % queues.size();
+            std::lock_guard<std::mutex> lock(*queue_locks[index]);
+            if(!queues[index].empty()){
+                task = std::move(queues[index].front());
+                queues[index].pop_front();
+                queued--;
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    void worker_loop(std::size_t index){
+        current_pool = this;
+        current_worker = index;
+        while(true){
+            if(run_pending_task()) continue;
+            
+            std::unique_lock<std::mutex> lock(sleep_lock);
+            if(stopping) return;
+            wake.wait(lock, [this](){ return stopping || queued>0; });
+        }
+    }
+    
+    std::vector<std::deque<std::function<void()> > > queues;
+    std::vector<std::unique_ptr<std::mutex> > queue_locks;
+    std::vector<std::thread> workers;
+    std::mutex sleep_lock;
+    std::condition_variable wake;
+    bool stopping;
+    std::atomic<int> queued;
+    std::atomic<std::size_t> next_queue;
+    
+    static thread_local Task_pool* current_pool;
+    static thread_local std::size_t current_worker;
+};
+thread_local Task_pool* Task_pool::current_pool = NULL;
+thread_local std::size_t Task_pool::current_worker = 0;
+
+Task_pool* task_pool = NULL; //This is only created if more than one thread is used (--threads).
+
+//A Task_group runs a set of tasks on the pool and waits for all of them to finish. Without a pool,
+//each task is run right away. The first exception thrown by a task is rethrown by wait.
+class Task_group{
+public:
+    explicit Task_group(Task_pool* pool) : pool(pool), pending(0){}
+    
+    void run(std::function<void()> task){
+        if(pool==NULL){
+            task();
+            return;
+        }
+        pending++;
+        pool->submit([this, task](){
+            try{
+                task();
+            }
+            catch(...){
+                std::lock_guard<std::mutex> lock(error_lock);
+                if(!error) error = std::current_exception();
+            }
+            pending--;
+        });
+    }
+    
+    void wait(){
+        while(pending>0)
+            if(!pool->run_pending_task()) std::this_thread::yield();
+        if(error) std::rethrow_exception(error);
+    }
+    
+private:
+    Task_pool* pool;
+    std::atomic<int> pending;
+    std::mutex error_lock;
+    std::exception_ptr error;
+};
+
+//------------------------------PROFILING--------------------------
+
+//With --profile (or --trace), each stage of the pipeline is timed with a Stage_timer, which adds the
+//time, the amount of Booleans run by the thread and the peak memory (RSS) of the process to the stats
+//of its stage. The stats are printed as a table at the end of the run, and with --trace each timed
+//stage is also written as a Chrome trace event (which can be opened in chrome://tracing or Perfetto).
+//Stages are nested, so the time of a stage includes the stages it calls (and any task its thread
+//runs while it waits on other threads).
+
+struct Stage_stats{
+    long calls = 0;
+    double seconds = 0;
+    long booleans = 0;
+    long peak_rss = 0; //In kilobytes.
+};
+
+struct Trace_event{
+    std::string name;
+    int thread;
+    double start; //In microseconds from the start of the run.
+    double duration;
+};
+
+std::mutex profile_lock;
+std::map<std::string, Stage_stats> stage_stats;
+std::map<std::string, long> profile_counters;
+std::vector<Trace_event> trace_events;
+std::atomic<long> boolean_count(0);
+thread_local long thread_boolean_count = 0;
+const std::chrono::steady_clock::time_point profile_start = std::chrono::steady_clock::now();
+
+//This returns the peak memory used by the process so far, in kilobytes (0 if it isn't available).
+long peak_rss(){
+#if defined(__unix__) || defined(__APPLE__)
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage)) return 0;
+#if defined(__APPLE__)
+    return usage.ru_maxrss/1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#else
+    return 0;
+#endif
+}
+
+//This is a small id for the current thread, used in the trace events.
+int profile_thread_id(){
+    static std::atomic<int> next_id(0);
+    thread_local int id = next_id++;
+    return id;
+}
+
+//This is called for each Boolean operation (a corefinement in the fast backend, a merge of two
+//solids in the exact backend).
+void count_boolean(){
+    boolean_count++;
+    thread_boolean_count++;
+}
+
+//This adds to a named counter (e.g. the amount of output faces) printed with the stats.
+void profile_count(const std::string& name, long value){
+    if(!profiling) return;
+    std::lock_guard<std::mutex> lock(profile_lock);
+    profile_counters[name]+=value;
+}
+
+class Stage_timer{
+public:
+    Stage_timer(const char* name) : name(name), active(profiling){
+        if(!active) return;
+        start = std::chrono::steady_clock::now();
+        booleans = thread_boolean_count;
+    }
+    
+    ~Stage_timer(){
+        if(!active) return;
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+        long rss = peak_rss();
+        
+        std::lock_guard<std::mutex> lock(profile_lock);
+        Stage_stats& stats = stage_stats[name];
+        stats.calls++;
+        stats.seconds+=std::chrono::duration<double>(end-start).count();
+        stats.booleans+=thread_boolean_count-booleans;
+        stats.peak_rss = std::max(stats.peak_rss, rss);
+        
+        if(!trace_file.empty()){
+            Trace_event event;
+            event.name = name;
+            event.thread = profile_thread_id();
+            event.start = std::chrono::duration<double, std::micro>(start-profile_start).count();
+            event.duration = std::chrono::duration<double, std::micro>(end-start).count();
+            trace_events.push_back(event);
+        }
+    }
+    
+private:
+    const char* name;
+    bool active;
+    std::chrono::steady_clock::time_point start;
+    long booleans;
+};
+
+//This prints the stats of each stage as a table, followed by the counters.
+void print_profile(){
+    std::lock_guard<std::mutex> lock(profile_lock);
+    char line[160];
+    snprintf(line, sizeof(line), "%-20s %8s %12s %12s %10s %14s", "Stage", "Calls", "Total (s)", "Avg (ms)", "Booleans", "Peak RSS (MB)");
+    std::cout << line << std::endl;
+    for(std::map<std::string, Stage_stats>::const_iterator it = stage_stats.begin(); it!=stage_stats.end(); ++it){
+        const Stage_stats& stats = it->second;
+        snprintf(line, sizeof(line), "%-20s %8ld %12.3f %12.3f %10ld %14.1f", it->first.c_str(), stats.calls, stats.seconds, stats.seconds*1000/stats.calls, stats.booleans, stats.peak_rss/1024.0);
+        std::cout << line << std::endl;
+    }
+    std::cout << "Booleans: " << boolean_count << std::endl;
+    for(std::map<std::string, long>::const_iterator it = profile_counters.begin(); it!=profile_counters.end(); ++it)
+        std::cout << it->first << ": " << it->second << std::endl;
+}
+
+//This writes the timed stages as Chrome trace events, with the stats and counters as metadata.
+void write_trace(std::string file_name){
+    std::lock_guard<std::mutex> lock(profile_lock);
+    std::ofstream out(file_name);
+    out << "{\"traceEvents\":[";
+    for(std::size_t i = 0; i<trace_events.size(); i++){
+        const Trace_event& event = trace_events[i];
+        out << (i ? ",\n" : "\n") << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.thread
+            << ",\"ts\":" << std::fixed << event.start << ",\"dur\":" << event.duration << "}";
+    }
+    out << "\n],\"otherData\":{\"booleans\":\"" << boolean_count << "\"";
+    for(std::map<std::string, long>::const_iterator it = profile_counters.begin(); it!=profile_counters.end(); ++it)
+        out << ",\"" << it->first << "\":\"" << it->second << "\"";
+    out << "}}\n";
+    out.close();
+}
+
+//------------------------------LOGGING--------------------------
+
+//The progress messages have a level: with --log quiet nothing is printed, with --log summary (the default)
+//each building prints its shape, a summary of its tiles and its file name, and with --log verbose every
+//tile, door and railing is printed as it is placed. Each thread writes its messages into its own buffer,
+//which is only written to stdout (under a lock, in one go) when it is full, when the thread finishes a
+//building, or when the thread exits, so the workers don't flush stdout for every line.
+
+enum Log_level{ LOG_QUIET, LOG_SUMMARY, LOG_VERBOSE };
+
+std::mutex log_lock;
+
+struct Log_buffer{
+    std::string text;
+    
+    void flush(){
+        if(text.empty()) return;
+        std::lock_guard<std::mutex> lock(log_lock);
+        std::cout << text << std::flush;
+        text.clear();
+    }
+    ~Log_buffer(){
+        flush();
+    }
+};
+thread_local Log_buffer log_buffer;
+
+//This returns the level of the --log option (quiet, summary or verbose).
+int parse_log_level(std::string level){
+    if(!level.compare("quiet")) return LOG_QUIET;
+    if(!level.compare("verbose")) return LOG_VERBOSE;
+    if(level.compare("summary")) std::cout << "Unknown log level: " << level << ", using summary" << std::endl;
+    return LOG_SUMMARY;
+}
+
+//This writes the calling thread's messages to stdout.
+void flush_log(){
+    log_buffer.flush();
+}
+
+//A Log_line is one message, which is added to the thread's buffer (if its level is logged) once the
+//line is complete, e.g. Log_line(LOG_VERBOSE) << "side: " << side;
+class Log_line{
+public:
+    explicit Log_line(int level) : enabled(level<=log_level){}
+    
+    template<class T>
+    Log_line& operator<<(const T& value){
+        if(enabled) stream << value;
+        return *this;
+    }
+    
+    ~Log_line(){
+        if(!enabled) return;
+        log_buffer.text += stream.str()+"\n";
+        if(log_buffer.text.size()>(1<<16)) log_buffer.flush();
+    }
+    
+private:
+    bool enabled;
+    std::ostringstream stream;
+};
+
+//The amount of each kind of tile placed on a side (or on a whole building), for the building's summary.
+struct Tile_counts{
+    std::atomic<long> windows{0};
+    std::atomic<long> removed{0};
+    std::atomic<long> railings{0};
+    std::atomic<long> doors{0};
+    
+    void add(const Tile_counts& other){
+        windows+=other.windows;
+        removed+=other.removed;
+        railings+=other.railings;
+        doors+=other.doors;
+    }
+};
+
+//------------------------------UNION REDUCTION--------------------------
+
+//Unioning parts one after another re-processes the ever growing solid at each step, so the cost is
+//roughly quadratic in the number of parts. Instead, the grammar gathers its parts into a list and
+//merges them pairwise as a balanced tree, so each union is between parts of a similar size.
+//Neighbouring parts (e.g. tiles in a row) are paired first.
+
+//This unions the list of parts (solids or assemblies). If parallel, each level of the tree is merged
+//as tasks on the pool. With --chain-unions, the parts are folded left to right as before (for comparison).
+//The exact backend counts each merge as a Boolean. The fast backend counts its corefinements instead.
+void count_merge(const Nef_polyhedron&){ count_boolean(); }
+void count_merge(const Fast_solid&){}
+
+template<class T>
+T union_reduce(std::vector<T> parts, bool parallel = true){
+    if(parts.empty()) return T();
+    
+    if(chain_unions){
+        T result = parts[0];
+        for(std::size_t i = 1; i<parts.size(); i++){
+            count_merge(parts[i]);
+            result+=parts[i];
+        }
+        return result;
+    }
+    
+    while(parts.size()>1){
+        std::vector<T> merged((parts.size()+1)/2);
+        Task_group group(parallel ? task_pool : NULL);
+        for(std::size_t i = 0; i<merged.size(); i++)
+            group.run([&, i](){
+                merged[i] = parts[i*2];
+                if(i*2+1<parts.size()){
+                    count_merge(parts[i*2+1]);
+                    merged[i]+=parts[i*2+1];
+                }
+            });
+        group.wait();
+        parts.swap(merged);
+    }
+    return parts[0];
+}
+
 //------------------------------TRANSFORMATIONS--------------------------
 
+//The transformations below are templated on the solid type (Nef_polyhedron or Fast_solid),
+//so that the same grammar can run on either backend.
+
+//With --snap N, every coordinate and translation is rounded to 1/N of a unit before it enters CGAL.
+//The dimensions of the grammar (tile_width = width/grid_width, the circumradius of a polygon, ...)
+//are rarely exact in binary, and each of them otherwise brings a full 53 bit mantissa into the exact
+//numbers, which then grow with every transformation and Boolean. Scale factors are ratios of two
+//dimensions, so they are rounded to 1/N^2 instead, which moves a scaled dimension far less than a unit.
+double snap(double value){
+    if(snap_grid<=0) return value;
+    return std::round(value*snap_grid)/snap_grid;
+}
+
+double snap_factor(double value){
+    if(snap_grid<=0) return value;
+    return std::round(value*snap_grid*snap_grid)/(snap_grid*snap_grid);
+}
+
+//This returns the translation by the (snapped) vector.
+template<class Solid>
+typename Solid::Aff_transformation_3 translation(double transl_x, double transl_y, double transl_z){
+    typedef typename Solid::Vector_3 Vector_3;
+    return typename Solid::Aff_transformation_3(CGAL::TRANSLATION, Vector_3(snap(transl_x), snap(transl_y), snap(transl_z)));
+}
+
 //The scale function transforms a Nef_polyhedron by scaling it.
-void scale(double scale_x, double scale_y, double scale_z, Nef_polyhedron& poly){
+template<class Solid>
+void scale(double scale_x, double scale_y, double scale_z, Solid& poly){
+    typedef typename Solid::Aff_transformation_3 Aff_transformation_3;
     
-    Aff_transformation_3 scale_size(scale_x*2,0,0,
-                                    0,scale_y*2,0,
-                                    0,0,scale_z*2,
+    Aff_transformation_3 scale_size(snap_factor(scale_x)*2,0,0,
+                                    0,snap_factor(scale_y)*2,0,
+                                    0,0,snap_factor(scale_z)*2,
                                     2);
     poly.transform(scale_size);
 }
 
 //The translate function transforms a Nef_polyhedron by moving it.
-void translate(double transl_x, double transl_y, double transl_z, Nef_polyhedron& poly){
-    Aff_transformation_3 transl(CGAL::TRANSLATION, Vector_3(transl_x, transl_y, transl_z));
-    poly.transform(transl);
+template<class Solid>
+void translate(double transl_x, double transl_y, double transl_z, Solid& poly){
+    poly.transform(translation<Solid>(transl_x, transl_y, transl_z));
 }
-//The rotate function transforms a Nef_polyhedron by rotating it by the x, y, z axis.
-void rotate(double rotate_x, double rotate_y, double rotate_z, Nef_polyhedron& poly){
+//Rotations are built from exact values wherever possible. A rotation by a multiple of 90 degrees uses
+//a matrix of 0s and 1s (so axis-aligned geometry stays axis-aligned, and the exact numbers stay small),
+//and any other angle uses a rational approximation whose cosine and sine are exactly on the unit circle
+//(so the rotation doesn't scale the solid). The denominator of the approximation is bounded, so the
+//error is below a millionth of a radian.
+const double rotation_denominator = 1<<20;
+
+//This returns the cosine and sine of the angle (in degrees) as cos_num/denominator and sin_num/denominator,
+//where each of them is an integer.
+void rational_rotation(double angle, double& cos_num, double& sin_num, double& denominator){
+    angle = fmod(angle, 360);
+    if(angle<0) angle+=360;
+    int quarter = llround(angle/90);
+    double rest = angle-quarter*90;
+    
+    double c = 1, s = 0;
+    denominator = 1;
+    if(std::abs(rest)>1e-9){
+        //The half angle tangent p/q gives the point ((q^2-p^2), 2pq)/(q^2+p^2) on the unit circle.
+        double q = rotation_denominator;
+        double p = llround(tan(rest*PI/360)*q);
+        c = q*q-p*p;
+        s = 2*p*q;
+        denominator = q*q+p*p;
+    }
     
-    double cos_x =cos(rotate_x*PI/180);
-    double sin_x =sin(rotate_x*PI/180);
-    Aff_transformation_3 rot_x(1,0,0,
-                               0,cos_x,-sin_x,
-                               0,sin_x,cos_x,
-                               1);
-    poly.transform(rot_x);
+    //The rest of the angle is made up of exact quarter turns.
+    switch(quarter%4){
+        case 0: cos_num = c; sin_num = s; break;
+        case 1: cos_num = -s; sin_num = c; break;
+        case 2: cos_num = -c; sin_num = -s; break;
+        default: cos_num = s; sin_num = -c; break;
+    }
+}
+
+//This returns true if the angle (in degrees) is a whole amount of turns.
+bool is_full_turn(double angle){
+    return fmod(angle, 360)==0;
+}
+
+//This returns the rotation by the x, y, z axis (in that order) as a single transformation. Axes which
+//aren't rotated are skipped.
+template<class Aff_transformation_3>
+Aff_transformation_3 rotation(double rotate_x, double rotate_y, double rotate_z){
+    Aff_transformation_3 rot(CGAL::IDENTITY);
+    double c, s, d;
+    
+    if(!is_full_turn(rotate_x)){
+        rational_rotation(rotate_x, c, s, d);
+        rot = Aff_transformation_3(d,0,0,
+                                   0,c,-s,
+                                   0,s,c,
+                                   d)*rot;
+    }
+    if(!is_full_turn(rotate_y)){
+        rational_rotation(rotate_y, c, s, d);
+        rot = Aff_transformation_3(c,0,s,
+                                   0,d,0,
+                                   -s,0,c,
+                                   d)*rot;
+    }
+    if(!is_full_turn(rotate_z)){
+        rational_rotation(rotate_z, c, s, d);
+        rot = Aff_transformation_3(c,-s,0,
+                                   s,c,0,
+                                   0,0,d,
+                                   d)*rot;
+    }
+    return rot;
+}
+
+//The rotate function transforms a Nef_polyhedron by rotating it by the x, y, z axis. The three
+//rotations are applied as one transformation, and not at all if none of the axes are rotated.
+template<class Solid>
+void rotate(double rotate_x, double rotate_y, double rotate_z, Solid& poly){
+    typedef typename Solid::Aff_transformation_3 Aff_transformation_3;
+    
+    if(is_full_turn(rotate_x) && is_full_turn(rotate_y) && is_full_turn(rotate_z)) return;
+    poly.transform(rotation<Aff_transformation_3>(rotate_x, rotate_y, rotate_z));
+}
+
+//------------------------------FAST BACKEND--------------------------
+
+//This section handles the Boolean operations of the fast backend. Instead of Nef Booleans, these use
+//corefinement from the Polygon Mesh Processing package on doubles. Parts which don't overlap are never
+//merged, and are just kept in the list of parts to be concatenated when the mesh is written.
+
+//The union adds each part of the other solid. If a part overlaps one already in the solid, the two are
+//corefined into a single part. If the corefinement fails (e.g. the result isn't manifold), both parts are kept.
+Fast_solid& operator+=(Fast_solid& solid, const Fast_solid& other){
     
-    cos_x =cos(rotate_y*PI/180);
-    sin_x =sin(rotate_y*PI/180);
-    Aff_transformation_3 rot_y(cos_x,0,sin_x,
-                               0,1,0,
-                               -sin_x,0,cos_x,
-                               1);
-    poly.transform(rot_y);
+    for(std::size_t j = 0; j<other.parts.size(); j++){
+        Fast_mesh merged = other.parts[j];
+        CGAL::Bbox_3 merged_box = CGAL::Polygon_mesh_processing::bbox(merged);
+        
+        std::size_t i = 0;
+        while(i<solid.parts.size()){
+            if(CGAL::do_overlap(merged_box, CGAL::Polygon_mesh_processing::bbox(solid.parts[i]))){
+                Fast_mesh result;
+                count_boolean();
+                if(CGAL::Polygon_mesh_processing::corefine_and_compute_union(solid.parts[i], merged, result)){
+                    //The merged part has grown, so every part is checked against it again.
+                    merged = result;
+                    merged_box = CGAL::Polygon_mesh_processing::bbox(merged);
+                    solid.parts.erase(solid.parts.begin()+i);
+                    i = 0;
+                    continue;
+                }
+            }
+            i++;
+        }
+        solid.parts.push_back(merged);
+    }
+    return solid;
+}
+
+Fast_solid operator+(const Fast_solid& solid, const Fast_solid& other){
+    Fast_solid result = solid;
+    result+=other;
+    return result;
+}
+
+//The difference subtracts every part of the other solid from each part it overlaps.
+Fast_solid operator-(const Fast_solid& solid, const Fast_solid& other){
+    Fast_solid result = solid;
+    
+    for(std::size_t i = 0; i<result.parts.size(); i++){
+        for(std::size_t j = 0; j<other.parts.size(); j++){
+            Fast_mesh subtract = other.parts[j];
+            if(!CGAL::do_overlap(CGAL::Polygon_mesh_processing::bbox(result.parts[i]), CGAL::Polygon_mesh_processing::bbox(subtract)))
+                continue;
+            
+            Fast_mesh difference;
+            count_boolean();
+            if(CGAL::Polygon_mesh_processing::corefine_and_compute_difference(result.parts[i], subtract, difference))
+                result.parts[i] = difference;
+        }
+    }
+    return result;
+}
+
+
+//------------------------------CSG TREE--------------------------
+
+//With --csg, the exact backend doesn't run the Booleans and transformations of the grammar right away.
+//Instead, each Csg_solid is the root of a CSG tree (primitive, transform, union and difference nodes),
+//which is only optimized and evaluated into Nef polyhedra when the building is written. The optimizer:
+//  - Composes stacked transforms into one.
+//  - Flattens chains of unions into a single union of all their parts.
+//  - Shares identical subtrees (so they are evaluated once) and drops repeated parts of a union.
+//  - Groups the parts of a union by overlapping bounding boxes. Groups which don't overlap are never
+//    unioned, and are just concatenated when the mesh is written (like the fast backend). Parts of a
+//    difference which don't overlap the subtracted solid are left as they are.
+//A transformed subtree is evaluated once and its result is copied and transformed for each placement,
+//so a window is only unioned once however many tiles it is placed in.
+
+struct Csg_node;
+typedef std::shared_ptr<const Csg_node> Csg_ptr;
+
+struct Csg_node{
+    enum Type{ PRIMITIVE, TRANSFORM, UNION, DIFFERENCE, CONCATENATION };
+    
+    Type type;
+    std::shared_ptr<const Nef_polyhedron> primitive; //Only used by PRIMITIVE.
+    Exact_kernel::Aff_transformation_3 transformation = Exact_kernel::Aff_transformation_3(CGAL::IDENTITY); //Only used by TRANSFORM.
+    std::vector<Csg_ptr> children; //A DIFFERENCE has two children, the solid and what is subtracted from it.
+    CGAL::Bbox_3 box; //The bounding box, slightly enlarged so parts which touch count as overlapping.
+};
+
+struct Csg_solid{
+    typedef Exact_kernel::Vector_3 Vector_3;
+    typedef Exact_kernel::Aff_transformation_3 Aff_transformation_3;
     
-    cos_x =cos(rotate_z*PI/180);
-    sin_x =sin(rotate_z*PI/180);
-    Aff_transformation_3 rot_z(cos_x,-sin_x,0,
-                               sin_x,cos_x,0,
-                               0,0,1,
-                               1);
-    poly.transform(rot_z);
+    Csg_ptr root; //NULL if the solid is empty.
     
+    void transform(const Aff_transformation_3& transformation);
+    bool is_empty() const{
+        return !root;
+    }
+};
+
+Csg_solid csg_cube_org; //The CSG backend's copies of the cube/cylinder.
+Csg_solid csg_cylinder_org;
+
+//This enlarges a box by a small tolerance, so rounding the exact coordinates to doubles never makes
+//touching or overlapping parts look disjoint.
+CGAL::Bbox_3 enlarge_box(const CGAL::Bbox_3& box){
+    double size = 1;
+    for(int i = 0; i<3; i++)
+        size = std::max(size, std::max(std::abs(box.min(i)), std::abs(box.max(i))));
+    double tolerance = size*1e-9;
+    return CGAL::Bbox_3(box.xmin()-tolerance, box.ymin()-tolerance, box.zmin()-tolerance, box.xmax()+tolerance, box.ymax()+tolerance, box.zmax()+tolerance);
+}
+
+CGAL::Bbox_3 nef_box(const Nef_polyhedron& nef){
+    CGAL::Bbox_3 box;
+    bool first = true;
+    for(Nef_polyhedron::Vertex_const_iterator v = nef.vertices_begin(); v!=nef.vertices_end(); ++v){
+        box = first ? v->point().bbox() : box+v->point().bbox();
+        first = false;
+    }
+    if(first) return box;
+    return enlarge_box(box);
 }
 
+//This returns the box around the transformed corners of the box.
+CGAL::Bbox_3 transform_box(const CGAL::Bbox_3& box, const Exact_kernel::Aff_transformation_3& transformation){
+    double m[3][4];
+    for(int r = 0; r<3; r++)
+        for(int c = 0; c<4; c++)
+            m[r][c] = CGAL::to_double(transformation.m(r, c));
+    
+    double low[3], high[3];
+    for(int corner = 0; corner<8; corner++){
+        double p[3] = {corner&1 ? box.xmax() : box.xmin(), corner&2 ? box.ymax() : box.ymin(), corner&4 ? box.zmax() : box.zmin()};
+        for(int r = 0; r<3; r++){
+            double value = m[r][0]*p[0]+m[r][1]*p[1]+m[r][2]*p[2]+m[r][3];
+            if(!corner || value<low[r]) low[r] = value;
+            if(!corner || value>high[r]) high[r] = value;
+        }
+    }
+    return enlarge_box(CGAL::Bbox_3(low[0], low[1], low[2], high[0], high[1], high[2]));
+}
+
+//This creates a node, and works out its bounding box from its children.
+Csg_ptr csg_node(Csg_node::Type type, std::vector<Csg_ptr> children, const Exact_kernel::Aff_transformation_3& transformation = Exact_kernel::Aff_transformation_3(CGAL::IDENTITY)){
+    std::shared_ptr<Csg_node> node = std::make_shared<Csg_node>();
+    node->type = type;
+    node->transformation = transformation;
+    node->children = children;
+    
+    if(type==Csg_node::TRANSFORM) node->box = transform_box(children[0]->box, transformation);
+    else if(type==Csg_node::DIFFERENCE) node->box = children[0]->box;
+    else{
+        node->box = children[0]->box;
+        for(std::size_t i = 1; i<children.size(); i++)
+            node->box+=children[i]->box;
+    }
+    return node;
+}
+
+Csg_solid csg_primitive(const Nef_polyhedron& nef){
+    std::shared_ptr<Csg_node> node = std::make_shared<Csg_node>();
+    node->type = Csg_node::PRIMITIVE;
+    node->primitive = std::make_shared<const Nef_polyhedron>(nef);
+    node->box = nef_box(nef);
+    
+    Csg_solid solid;
+    solid.root = node;
+    return solid;
+}
+
+//Stacked transforms are composed as they are recorded.
+void Csg_solid::transform(const Aff_transformation_3& transformation){
+    if(!root) return;
+    if(root->type==Csg_node::TRANSFORM) root = csg_node(Csg_node::TRANSFORM, root->children, transformation*root->transformation);
+    else root = csg_node(Csg_node::TRANSFORM, {root}, transformation);
+}
+
+Csg_solid& operator+=(Csg_solid& solid, const Csg_solid& other){
+    if(!other.root) return solid;
+    if(!solid.root) solid.root = other.root;
+    else solid.root = csg_node(Csg_node::UNION, {solid.root, other.root});
+    return solid;
+}
+
+Csg_solid operator+(const Csg_solid& solid, const Csg_solid& other){
+    Csg_solid result = solid;
+    result+=other;
+    return result;
+}
+
+Csg_solid operator-(const Csg_solid& solid, const Csg_solid& other){
+    Csg_solid result = solid;
+    if(solid.root && other.root) result.root = csg_node(Csg_node::DIFFERENCE, {solid.root, other.root});
+    return result;
+}
+
+//The Booleans of a tree are counted when it is evaluated, not when unioned.
+void count_merge(const Csg_solid&){}
+
+//The optimizer rewrites the tree from the bottom up. Every node it creates goes through share, which
+//returns the existing node if an identical one was already created.
+class Csg_optimizer{
+public:
+    Csg_ptr optimize(const Csg_ptr& node){
+        std::map<const Csg_node*, Csg_ptr>::iterator it = optimized.find(node.get());
+        if(it!=optimized.end()) return it->second;
+        
+        Csg_ptr result;
+        if(node->type==Csg_node::PRIMITIVE) result = share(node);
+        else if(node->type==Csg_node::TRANSFORM) result = optimize_transform(optimize(node->children[0]), node->transformation);
+        else if(node->type==Csg_node::DIFFERENCE) result = optimize_difference(optimize(node->children[0]), optimize(node->children[1]));
+        else{
+            std::vector<Csg_ptr> parts;
+            for(std::size_t i = 0; i<node->children.size(); i++)
+                parts.push_back(optimize(node->children[i]));
+            result = optimize_union(parts);
+        }
+        
+        optimized[node.get()] = result;
+        return result;
+    }
+    
+private:
+    //Composes the transform with the child's, and moves it onto each part of a concatenation (which
+    //costs nothing) so the parts can be regrouped by the union above.
+    Csg_ptr optimize_transform(const Csg_ptr& child, const Exact_kernel::Aff_transformation_3& transformation){
+        if(child->type==Csg_node::TRANSFORM)
+            return share(csg_node(Csg_node::TRANSFORM, child->children, transformation*child->transformation));
+        if(child->type==Csg_node::CONCATENATION){
+            std::vector<Csg_ptr> parts;
+            for(std::size_t i = 0; i<child->children.size(); i++)
+                parts.push_back(optimize_transform(child->children[i], transformation));
+            return share(csg_node(Csg_node::CONCATENATION, parts));
+        }
+        return share(csg_node(Csg_node::TRANSFORM, {child}, transformation));
+    }
+    
+    //Flattens the unions and concatenations among the parts, drops repeated parts, and then groups the
+    //parts whose boxes overlap (directly or through other parts). Only the parts of a group are unioned.
+    Csg_ptr optimize_union(const std::vector<Csg_ptr>& children){
+        std::vector<Csg_ptr> parts;
+        for(std::size_t i = 0; i<children.size(); i++){
+            if(children[i]->type==Csg_node::UNION || children[i]->type==Csg_node::CONCATENATION)
+                parts.insert(parts.end(), children[i]->children.begin(), children[i]->children.end());
+            else parts.push_back(children[i]);
+        }
+        std::vector<Csg_ptr> unique;
+        for(std::size_t i = 0; i<parts.size(); i++)
+            if(std::find(unique.begin(), unique.end(), parts[i])==unique.end())
+                unique.push_back(parts[i]);
+        if(unique.size()==1) return unique[0];
+        
+        std::vector<std::size_t> group(unique.size());
+        for(std::size_t i = 0; i<unique.size(); i++) group[i] = i;
+        for(std::size_t i = 0; i<unique.size(); i++)
+            for(std::size_t j = i+1; j<unique.size(); j++)
+                if(CGAL::do_overlap(unique[i]->box, unique[j]->box)){
+                    std::size_t a = find_group(group, i), b = find_group(group, j);
+                    if(a!=b) group[std::max(a, b)] = std::min(a, b);
+                }
+        
+        std::map<std::size_t, std::vector<Csg_ptr> > groups;
+        for(std::size_t i = 0; i<unique.size(); i++)
+            groups[find_group(group, i)].push_back(unique[i]);
+        
+        std::vector<Csg_ptr> concatenated;
+        for(std::map<std::size_t, std::vector<Csg_ptr> >::iterator it = groups.begin(); it!=groups.end(); ++it)
+            concatenated.push_back(it->second.size()==1 ? it->second[0] : share(csg_node(Csg_node::UNION, it->second)));
+        if(concatenated.size()==1) return concatenated[0];
+        return share(csg_node(Csg_node::CONCATENATION, concatenated));
+    }
+    
+    //Only the parts of the subtracted solid which overlap are kept, and each part of a concatenation
+    //only has the parts overlapping it subtracted.
+    Csg_ptr optimize_difference(const Csg_ptr& solid, const Csg_ptr& subtract){
+        std::vector<Csg_ptr> solid_parts = parts_of(solid);
+        std::vector<Csg_ptr> subtract_parts = parts_of(subtract);
+        
+        std::vector<Csg_ptr> result;
+        bool changed = false;
+        for(std::size_t i = 0; i<solid_parts.size(); i++){
+            std::vector<Csg_ptr> overlapping;
+            for(std::size_t j = 0; j<subtract_parts.size(); j++)
+                if(CGAL::do_overlap(solid_parts[i]->box, subtract_parts[j]->box))
+                    overlapping.push_back(subtract_parts[j]);
+            
+            if(overlapping.empty()) result.push_back(solid_parts[i]);
+            else{
+                Csg_ptr cut = overlapping.size()==1 ? overlapping[0] : share(csg_node(Csg_node::CONCATENATION, overlapping));
+                result.push_back(share(csg_node(Csg_node::DIFFERENCE, {solid_parts[i], cut})));
+                changed = true;
+            }
+        }
+        if(!changed) return solid;
+        if(result.size()==1) return result[0];
+        return share(csg_node(Csg_node::CONCATENATION, result));
+    }
+    
+    static std::vector<Csg_ptr> parts_of(const Csg_ptr& node){
+        if(node->type==Csg_node::CONCATENATION) return node->children;
+        return std::vector<Csg_ptr>(1, node);
+    }
+    
+    static std::size_t find_group(std::vector<std::size_t>& group, std::size_t i){
+        while(group[i]!=i) i = group[i] = group[group[i]];
+        return i;
+    }
+    
+    //Nodes are looked up by their type, children and primitive. Transforms are then compared exactly.
+    struct Key{
+        int type;
+        const void* primitive;
+        std::vector<const Csg_node*> children;
+        
+        bool operator<(const Key& other) const{
+            if(type!=other.type) return type<other.type;
+            if(primitive!=other.primitive) return primitive<other.primitive;
+            return children<other.children;
+        }
+    };
+    
+    Csg_ptr share(const Csg_ptr& node){
+        Key key;
+        key.type = node->type;
+        key.primitive = node->primitive.get();
+        for(std::size_t i = 0; i<node->children.size(); i++)
+            key.children.push_back(node->children[i].get());
+        
+        std::vector<Csg_ptr>& bucket = shared[key];
+        for(std::size_t i = 0; i<bucket.size(); i++)
+            if(node->type!=Csg_node::TRANSFORM || same_transformation(bucket[i]->transformation, node->transformation))
+                return bucket[i];
+        bucket.push_back(node);
+        return node;
+    }
+    
+    static bool same_transformation(const Exact_kernel::Aff_transformation_3& a, const Exact_kernel::Aff_transformation_3& b){
+        for(int r = 0; r<3; r++)
+            for(int c = 0; c<4; c++)
+                if(a.m(r, c)!=b.m(r, c)) return false;
+        return true;
+    }
+    
+    std::map<const Csg_node*, Csg_ptr> optimized;
+    std::map<Key, std::vector<Csg_ptr> > shared;
+};
+
+//A part of an evaluated tree. The parts don't overlap, so they are concatenated when written.
+struct Csg_part{
+    Nef_polyhedron nef;
+    CGAL::Bbox_3 box;
+};
+
+//The evaluator runs the Booleans of the optimized tree. Each node is only evaluated once.
+class Csg_evaluator{
+public:
+    const std::vector<Csg_part>& evaluate(const Csg_ptr& node){
+        std::map<const Csg_node*, std::vector<Csg_part> >::iterator it = evaluated.find(node.get());
+        if(it!=evaluated.end()) return it->second;
+        
+        std::vector<Csg_part> parts;
+        if(node->type==Csg_node::PRIMITIVE){
+            Csg_part part = {*node->primitive, node->box};
+            parts.push_back(part);
+        }
+        else if(node->type==Csg_node::TRANSFORM){
+            parts = evaluate(node->children[0]);
+            for(std::size_t i = 0; i<parts.size(); i++){
+                parts[i].nef.transform(node->transformation);
+                parts[i].box = transform_box(parts[i].box, node->transformation);
+            }
+        }
+        else if(node->type==Csg_node::CONCATENATION){
+            for(std::size_t i = 0; i<node->children.size(); i++){
+                const std::vector<Csg_part>& child = evaluate(node->children[i]);
+                parts.insert(parts.end(), child.begin(), child.end());
+            }
+        }
+        else if(node->type==Csg_node::UNION){
+            std::vector<Nef_polyhedron> nefs;
+            for(std::size_t i = 0; i<node->children.size(); i++){
+                const std::vector<Csg_part>& child = evaluate(node->children[i]);
+                for(std::size_t j = 0; j<child.size(); j++)
+                    nefs.push_back(child[j].nef);
+            }
+            Csg_part part = {union_reduce(nefs), node->box};
+            parts.push_back(part);
+        }
+        else{
+            parts = evaluate(node->children[0]);
+            const std::vector<Csg_part>& subtract = evaluate(node->children[1]);
+            for(std::size_t i = 0; i<parts.size(); i++)
+                for(std::size_t j = 0; j<subtract.size(); j++)
+                    if(CGAL::do_overlap(parts[i].box, subtract[j].box)){
+                        count_boolean();
+                        parts[i].nef = parts[i].nef-subtract[j].nef;
+                    }
+        }
+        
+        return evaluated[node.get()] = parts;
+    }
+    
+private:
+    std::map<const Csg_node*, std::vector<Csg_part> > evaluated;
+};
+
+//This optimizes and evaluates the tree of a solid, returning its parts.
+std::vector<Csg_part> evaluate_csg(const Csg_solid& solid){
+    if(!solid.root) return std::vector<Csg_part>();
+    
+    Csg_ptr root;
+    {
+        Stage_timer timer("csg optimize");
+        Csg_optimizer optimizer;
+        root = optimizer.optimize(solid.root);
+    }
+    
+    Stage_timer timer("csg evaluate");
+    Csg_evaluator evaluator;
+    return evaluator.evaluate(root);
+}
+
+//------------------------------LAZY TRANSFORMS--------------------------
+
+//Every transformation of a Nef_polyhedron walks all of its vertices and planes with exact arithmetic,
+//and the grammar often scales, translates and rotates the same part several times in a row (and then
+//moves the facade and the building again). A Lazy_nef only records these transformations, composed
+//into a single matrix, and applies it once when the geometry is actually needed: before a Boolean
+//operation, or when the building is written. This is the default for the exact backend
+//(--eager-transforms applies each transformation right away, as Nef_polyhedron does).
+struct Lazy_nef{
+    typedef Exact_kernel::Vector_3 Vector_3;
+    typedef Exact_kernel::Aff_transformation_3 Aff_transformation_3;
+    
+    Nef_polyhedron nef;
+    Aff_transformation_3 pending = Aff_transformation_3(CGAL::IDENTITY); //Applied after nef's own geometry.
+    bool transformed = false;
+    
+    Lazy_nef(){}
+    Lazy_nef(const Nef_polyhedron& nef) : nef(nef){}
+    
+    void transform(const Aff_transformation_3& transformation){
+        pending = transformed ? transformation*pending : transformation;
+        transformed = true;
+    }
+    
+    //This applies the pending transformation to the polyhedron itself.
+    void apply(){
+        if(!transformed) return;
+        nef.transform(pending);
+        pending = Aff_transformation_3(CGAL::IDENTITY);
+        transformed = false;
+    }
+    
+    //This returns the transformed polyhedron, without changing the solid.
+    Nef_polyhedron applied() const{
+        Nef_polyhedron result = nef;
+        if(transformed) result.transform(pending);
+        return result;
+    }
+    
+    //A transformation never makes a solid empty (or not empty), so it doesn't need to be applied.
+    bool is_empty() const{
+        return nef.is_empty();
+    }
+};
+
+Lazy_nef lazy_cube_org; //The lazy backend's copies of the cube/cylinder.
+Lazy_nef lazy_cylinder_org;
+
+void count_merge(const Lazy_nef&){ count_boolean(); }
+
+Lazy_nef& operator+=(Lazy_nef& solid, const Lazy_nef& other){
+    solid.apply();
+    solid.nef+=other.applied();
+    return solid;
+}
+
+Lazy_nef operator+(const Lazy_nef& solid, const Lazy_nef& other){
+    return Lazy_nef(solid.applied()+other.applied());
+}
+
+Lazy_nef operator-(const Lazy_nef& solid, const Lazy_nef& other){
+    return Lazy_nef(solid.applied()-other.applied());
+}
+
+//------------------------------MESH BUILDERS--------------------------
+
+//These build the closed triangle meshes of the primitives directly from their vertices, instead of
+//parsing an OFF string, computing a convex hull or subtracting one solid from another. Every face is
+//a triangle (which the fast backend's corefinement needs), oriented counterclockwise seen from outside.
+
+struct Mesh_builder{
+    std::vector<std::array<double, 3> > points;
+    std::vector<std::vector<std::size_t> > triangles;
+    
+    std::size_t add_point(double x, double y, double z){
+        std::array<double, 3> point = {{snap(x), snap(y), snap(z)}};
+        points.push_back(point);
+        return points.size()-1;
+    }
+    void add_triangle(std::size_t a, std::size_t b, std::size_t c){
+        std::vector<std::size_t> triangle = {a, b, c};
+        triangles.push_back(triangle);
+    }
+    //The quad is split into two triangles (it must be convex).
+    void add_quad(std::size_t a, std::size_t b, std::size_t c, std::size_t d){
+        add_triangle(a, b, c);
+        add_triangle(a, c, d);
+    }
+};
+
+typedef std::vector<std::array<double, 2> > Outline;
+
+//This returns the points of a regular n sided polygon around the origin, counterclockwise.
+Outline regular_outline(double circumradius, int sides){
+    double sum_angle = (sides-2)*180;
+    double side_angle = sum_angle/sides;
+    
+    Outline outline;
+    for(int i =0; i<sides;i++){
+        std::array<double, 2> point = {{circumradius*cos(((180-side_angle)*i)*PI/180), circumradius*sin(((180-side_angle)*i)*PI/180)}};
+        outline.push_back(point);
+    }
+    return outline;
+}
+
+//This returns the polygon used by the polygon buildings, whose width is the length of each side.
+//Note: circumradius_addition is the amount to add to the circumradius, for use with the overhangs.
+Outline polygon_outline(double circumradius_addition, double width, int sides){
+    double sin_x =sin((180/sides)*PI/180);
+    double circumradius = width/(2*sin_x)+circumradius_addition;//Length to vertex
+    return regular_outline(circumradius, sides);
+}
+
+//This returns the corners of a width by length rectangle around the origin, counterclockwise.
+Outline rectangle_outline(double width, double length){
+    Outline outline = {{{-width/2, -length/2}}, {{width/2, -length/2}}, {{width/2, length/2}}, {{-width/2, length/2}}};
+    return outline;
+}
+
+//This adds the outline at the height z, returning the index of its first point.
+std::size_t add_outline(Mesh_builder& mesh, const Outline& outline, double z){
+    std::size_t first = mesh.points.size();
+    for(std::size_t i = 0; i<outline.size(); i++)
+        mesh.add_point(outline[i][0], outline[i][1], z);
+    return first;
+}
+
+//This adds the convex outline starting at the first point as a fan of triangles, facing up or down.
+void add_cap(Mesh_builder& mesh, std::size_t first, std::size_t count, bool up){
+    for(std::size_t i = 1; i+1<count; i++){
+        if(up) mesh.add_triangle(first, first+i, first+i+1);
+        else mesh.add_triangle(first, first+i+1, first+i);
+    }
+}
+
+//This adds the walls between two copies of an outline (bottom below top), facing out or in.
+void add_walls(Mesh_builder& mesh, std::size_t bottom, std::size_t top, std::size_t count, bool out){
+    for(std::size_t i = 0; i<count; i++){
+        std::size_t j = (i+1)%count;
+        if(out) mesh.add_quad(bottom+i, bottom+j, top+j, top+i);
+        else mesh.add_quad(bottom+i, top+i, top+j, bottom+j);
+    }
+}
+
+//A prism of the convex outline (counterclockwise) from z_bottom to z_top.
+Mesh_builder prism_mesh(const Outline& outline, double z_bottom, double z_top){
+    Mesh_builder mesh;
+    std::size_t bottom = add_outline(mesh, outline, z_bottom);
+    std::size_t top = add_outline(mesh, outline, z_top);
+    add_cap(mesh, bottom, outline.size(), false);
+    add_cap(mesh, top, outline.size(), true);
+    add_walls(mesh, bottom, top, outline.size(), true);
+    return mesh;
+}
+
+//A box of the given size around the origin.
+Mesh_builder box_mesh(double width, double length, double height){
+    return prism_mesh(rectangle_outline(width, length), -height/2, height/2);
+}
+
+//A hollow frame (or ring) prism from z_bottom to z_top, between the outer and inner outlines, which have
+//the same amount of points, each inner point lying inside the outer outline towards its outer point.
+//If floor is above 0, the hole doesn't go all the way down, and leaves a floor of that thickness.
+Mesh_builder frame_prism_mesh(const Outline& outer, const Outline& inner, double z_bottom, double z_top, double floor){
+    Mesh_builder mesh;
+    std::size_t count = outer.size();
+    std::size_t outer_bottom = add_outline(mesh, outer, z_bottom);
+    std::size_t outer_top = add_outline(mesh, outer, z_top);
+    std::size_t inner_bottom = add_outline(mesh, inner, z_bottom+floor);
+    std::size_t inner_top = add_outline(mesh, inner, z_top);
+    
+    add_walls(mesh, outer_bottom, outer_top, count, true);
+    add_walls(mesh, inner_bottom, inner_top, count, false);
+    
+    //The top is a ring between the two outlines.
+    for(std::size_t i = 0; i<count; i++){
+        std::size_t j = (i+1)%count;
+        mesh.add_quad(outer_top+i, outer_top+j, inner_top+j, inner_top+i);
+    }
+    
+    //The bottom is either another ring, or the whole outer outline with the floor of the hole above it.
+    if(floor>0){
+        add_cap(mesh, outer_bottom, count, false);
+        add_cap(mesh, inner_bottom, count, true);
+    }
+    else{
+        for(std::size_t i = 0; i<count; i++){
+            std::size_t j = (i+1)%count;
+            mesh.add_quad(outer_bottom+i, inner_bottom+i, inner_bottom+j, outer_bottom+j);
+        }
+    }
+    return mesh;
+}
+
+//These convert a built mesh into a solid of each backend.
+template<class Solid> Solid mesh_solid(const Mesh_builder& mesh);
+
+template<> Nef_polyhedron mesh_solid<Nef_polyhedron>(const Mesh_builder& mesh){
+    std::vector<Point_3> points;
+    for(std::size_t i = 0; i<mesh.points.size(); i++)
+        points.push_back(Point_3(mesh.points[i][0], mesh.points[i][1], mesh.points[i][2]));
+    
+    Polyhedron_3 polyhedron;
+    CGAL::Polygon_mesh_processing::polygon_soup_to_polygon_mesh(points, mesh.triangles, polyhedron);
+    return Nef_polyhedron(polyhedron);
+}
+
+template<> Fast_solid mesh_solid<Fast_solid>(const Mesh_builder& mesh){
+    std::vector<Fast_kernel::Point_3> points;
+    for(std::size_t i = 0; i<mesh.points.size(); i++)
+        points.push_back(Fast_kernel::Point_3(mesh.points[i][0], mesh.points[i][1], mesh.points[i][2]));
+    
+    Fast_solid solid;
+    solid.parts.push_back(Fast_mesh());
+    CGAL::Polygon_mesh_processing::polygon_soup_to_polygon_mesh(points, mesh.triangles, solid.parts[0]);
+    return solid;
+}
+
+template<> Csg_solid mesh_solid<Csg_solid>(const Mesh_builder& mesh){
+    return csg_primitive(mesh_solid<Nef_polyhedron>(mesh));
+}
+
+template<> Lazy_nef mesh_solid<Lazy_nef>(const Mesh_builder& mesh){
+    return Lazy_nef(mesh_solid<Nef_polyhedron>(mesh));
+}
+
+//------------------------------2D FACADES--------------------------
+
+//A facade is a flat grid of tiles, whose window, door and railing parts are nearly all boxes sticking out
+//of the wall along the facade's x axis (its depth). With --facade-2d, each facade is generated with the
+//Flat_solid below, which only records its parts in facade-local coordinates. The boxes are then laid
+//out as 2D polygon sets (the y, z rectangles of the facade) and joined with 2D Booleans, one set for each
+//layer of depth, and each layer is extruded into a single mesh. This replaces the 3D Boolean per part
+//with 2D work per facade, and the facade is then placed on its side with one transformation.
+
+//A Flat_box is an axis-aligned box, from min to max on the x, y and z axis.
+struct Flat_box{
+    double min[3];
+    double max[3];
+};
+
+//A Flat_part is any other part (cylinders, or boxes which were rotated off the axes). It is kept as
+//its mesh, which is shared by the copies of the part, and the transformation applied to it so far.
+//These parts are merged with the extruded layers as 3D solids.
+struct Flat_part{
+    std::shared_ptr<const Mesh_builder> mesh;
+    Fast_kernel::Aff_transformation_3 transformation;
+};
+
+struct Flat_solid{
+    typedef Fast_kernel::Vector_3 Vector_3;
+    typedef Fast_kernel::Aff_transformation_3 Aff_transformation_3;
+    
+    std::vector<Flat_box> boxes;
+    std::vector<Flat_part> parts;
+    
+    //A transformation which keeps the axes on the axes (scaling, translation and quarter turns) moves the
+    //boxes. Any other transformation turns the boxes into parts first.
+    void transform(const Aff_transformation_3& transformation){
+        if(!keeps_axes(transformation)){
+            for(std::size_t i = 0; i<boxes.size(); i++){
+                Flat_part part;
+                part.mesh = std::make_shared<const Mesh_builder>(box_part_mesh(boxes[i]));
+                part.transformation = Aff_transformation_3(CGAL::IDENTITY);
+                parts.push_back(part);
+            }
+            boxes.clear();
+        }
+        
+        for(std::size_t i = 0; i<boxes.size(); i++){
+            Fast_kernel::Point_3 a = transformation(Fast_kernel::Point_3(boxes[i].min[0], boxes[i].min[1], boxes[i].min[2]));
+            Fast_kernel::Point_3 b = transformation(Fast_kernel::Point_3(boxes[i].max[0], boxes[i].max[1], boxes[i].max[2]));
+            for(int axis = 0; axis<3; axis++){
+                boxes[i].min[axis] = std::min(a[axis], b[axis]);
+                boxes[i].max[axis] = std::max(a[axis], b[axis]);
+            }
+        }
+        for(std::size_t i = 0; i<parts.size(); i++)
+            parts[i].transformation = transformation*parts[i].transformation;
+    }
+    bool is_empty() const{
+        return boxes.empty() && parts.empty();
+    }
+    
+    //This returns true if each axis is mapped onto a single axis.
+    static bool keeps_axes(const Aff_transformation_3& transformation){
+        for(int i = 0; i<3; i++){
+            int axes = 0;
+            for(int j = 0; j<3; j++)
+                if(transformation.m(i, j)!=0) axes++;
+            if(axes!=1) return false;
+        }
+        return true;
+    }
+    
+    static Mesh_builder box_part_mesh(const Flat_box& box){
+        Outline outline = {{{box.min[0], box.min[1]}}, {{box.max[0], box.min[1]}}, {{box.max[0], box.max[1]}}, {{box.min[0], box.max[1]}}};
+        return prism_mesh(outline, box.min[2], box.max[2]);
+    }
+};
+
+Flat_solid flat_cube_org; //The 2D facades' copies of the cube/cylinder.
+Flat_solid flat_cylinder_org;
+
+//Recording a part is never a Boolean.
+void count_merge(const Flat_solid&){}
+
+Flat_solid& operator+=(Flat_solid& solid, const Flat_solid& other){
+    solid.boxes.insert(solid.boxes.end(), other.boxes.begin(), other.boxes.end());
+    solid.parts.insert(solid.parts.end(), other.parts.begin(), other.parts.end());
+    return solid;
+}
+
+Flat_solid operator+(const Flat_solid& solid, const Flat_solid& other){
+    Flat_solid result = solid;
+    result+=other;
+    return result;
+}
+
+//This returns a solid of a single box.
+Flat_solid flat_box(double min_x, double min_y, double min_z, double max_x, double max_y, double max_z){
+    Flat_box box = {{min_x, min_y, min_z}, {max_x, max_y, max_z}};
+    Flat_solid solid;
+    solid.boxes.push_back(box);
+    return solid;
+}
+
+template<> Flat_solid mesh_solid<Flat_solid>(const Mesh_builder& mesh){
+    Flat_part part;
+    part.mesh = std::make_shared<const Mesh_builder>(mesh);
+    part.transformation = Flat_solid::Aff_transformation_3(CGAL::IDENTITY);
+    
+    Flat_solid solid;
+    solid.parts.push_back(part);
+    return solid;
+}
+
+typedef CGAL::Polygon_2<Exact_kernel> Polygon_2;
+typedef CGAL::Polygon_with_holes_2<Exact_kernel> Polygon_with_holes_2;
+typedef CGAL::Polygon_set_2<Exact_kernel> Polygon_set_2;
+
+//This adds the walls along one boundary of a region, which has the inside of the region on its left,
+//from the depth x_front to x_back.
+void add_region_walls(Mesh_builder& mesh, const Polygon_2& boundary, double x_front, double x_back, std::map<std::pair<double, double>, std::size_t> points[2]){
+    std::vector<std::size_t> front, back;
+    for(Polygon_2::Vertex_const_iterator it = boundary.vertices_begin(); it!=boundary.vertices_end(); ++it){
+        std::pair<double, double> point(CGAL::to_double(it->x()), CGAL::to_double(it->y()));
+        if(!points[0].count(point)) points[0][point] = mesh.add_point(x_front, point.first, point.second);
+        if(!points[1].count(point)) points[1][point] = mesh.add_point(x_back, point.first, point.second);
+        front.push_back(points[0][point]);
+        back.push_back(points[1][point]);
+    }
+    for(std::size_t i = 0; i<front.size(); i++){
+        std::size_t j = (i+1)%front.size();
+        mesh.add_quad(front[i], front[j], back[j], back[i]);
+    }
+}
+
+//This extrudes a region of the facade (its y, z polygon with holes) from the depth x_front to x_back.
+//The front and back are triangulated without adding any points, so they share every point of the walls.
+Mesh_builder extrude_region(const Polygon_with_holes_2& region, double x_front, double x_back){
+    Mesh_builder mesh;
+    std::map<std::pair<double, double>, std::size_t> points[2];
+    
+    Polygon_2 outer = region.outer_boundary();
+    if(!outer.is_counterclockwise_oriented()) outer.reverse_orientation();
+    add_region_walls(mesh, outer, x_front, x_back, points);
+    for(Polygon_with_holes_2::Hole_const_iterator it = region.holes_begin(); it!=region.holes_end(); ++it){
+        Polygon_2 hole = *it;
+        if(hole.is_counterclockwise_oriented()) hole.reverse_orientation();
+        add_region_walls(mesh, hole, x_front, x_back, points);
+    }
+    
+    std::vector<Polygon_2> triangles;
+    CGAL::Polygon_triangulation_decomposition_2<Exact_kernel> triangulate;
+    triangulate(region, std::back_inserter(triangles));
+    for(std::size_t i = 0; i<triangles.size(); i++){
+        if(!triangles[i].is_counterclockwise_oriented()) triangles[i].reverse_orientation();
+        std::size_t corners[2][3];
+        for(int j = 0; j<3; j++){
+            std::pair<double, double> point(CGAL::to_double(triangles[i][j].x()), CGAL::to_double(triangles[i][j].y()));
+            corners[0][j] = points[0][point];
+            corners[1][j] = points[1][point];
+        }
+        mesh.add_triangle(corners[0][0], corners[0][2], corners[0][1]);
+        mesh.add_triangle(corners[1][0], corners[1][1], corners[1][2]);
+    }
+    return mesh;
+}
+
+//This turns the recorded facade into a solid of the backend. The depths of the boxes split the facade
+//into layers, and neighbouring layers covered by the same boxes are extruded as one. The boxes of each
+//layer are joined as 2D rectangles, and each region of the result is extruded. The other parts are
+//converted once for each mesh they share, and all of them are unioned with the extruded regions.
+template<class Solid>
+Solid extrude_flat(const Flat_solid& flat){
+    Stage_timer timer("extrude facade");
+    typedef typename Solid::Aff_transformation_3 Aff_transformation_3;
+    
+    std::vector<double> depths;
+    for(std::size_t i = 0; i<flat.boxes.size(); i++){
+        depths.push_back(flat.boxes[i].min[0]);
+        depths.push_back(flat.boxes[i].max[0]);
+    }
+    std::sort(depths.begin(), depths.end());
+    depths.erase(std::unique(depths.begin(), depths.end()), depths.end());
+    
+    //Each layer is the boxes covering it, from depths[first] to depths[last].
+    std::vector<std::vector<std::size_t> > layer_boxes;
+    std::vector<std::pair<std::size_t, std::size_t> > layer_depths;
+    for(std::size_t d = 0; d+1<depths.size(); d++){
+        std::vector<std::size_t> covering;
+        for(std::size_t i = 0; i<flat.boxes.size(); i++)
+            if(flat.boxes[i].min[0]<=depths[d] && flat.boxes[i].max[0]>=depths[d+1])
+                covering.push_back(i);
+        
+        if(!layer_boxes.empty() && layer_depths.back().second==d && layer_boxes.back()==covering)
+            layer_depths.back().second = d+1;
+        else if(!covering.empty()){
+            layer_boxes.push_back(covering);
+            layer_depths.push_back(std::make_pair(d, d+1));
+        }
+    }
+    
+    std::vector<Solid> solids(layer_boxes.size());
+    Task_group group(task_pool);
+    for(std::size_t l = 0; l<layer_boxes.size(); l++)
+        group.run([&, l](){
+            std::vector<Polygon_2> rectangles;
+            for(std::size_t i = 0; i<layer_boxes[l].size(); i++){
+                const Flat_box& box = flat.boxes[layer_boxes[l][i]];
+                Polygon_2 rectangle;
+                rectangle.push_back(Exact_kernel::Point_2(box.min[1], box.min[2]));
+                rectangle.push_back(Exact_kernel::Point_2(box.max[1], box.min[2]));
+                rectangle.push_back(Exact_kernel::Point_2(box.max[1], box.max[2]));
+                rectangle.push_back(Exact_kernel::Point_2(box.min[1], box.max[2]));
+                rectangles.push_back(rectangle);
+            }
+            Polygon_set_2 layer;
+            layer.join(rectangles.begin(), rectangles.end());
+            
+            std::vector<Polygon_with_holes_2> regions;
+            layer.polygons_with_holes(std::back_inserter(regions));
+            std::vector<Solid> extruded;
+            for(std::size_t i = 0; i<regions.size(); i++)
+                extruded.push_back(mesh_solid<Solid>(extrude_region(regions[i], depths[layer_depths[l].first], depths[layer_depths[l].second])));
+            solids[l] = union_reduce(extruded, false);
+        });
+    group.wait();
+    profile_count("extruded layers", layer_boxes.size());
+    
+    std::map<const Mesh_builder*, Solid> converted;
+    for(std::size_t i = 0; i<flat.parts.size(); i++){
+        const Flat_part& part = flat.parts[i];
+        if(!converted.count(part.mesh.get()))
+            converted[part.mesh.get()] = mesh_solid<Solid>(*part.mesh);
+        
+        const Flat_solid::Aff_transformation_3& t = part.transformation;
+        Solid solid = converted[part.mesh.get()];
+        solid.transform(Aff_transformation_3(t.m(0,0), t.m(0,1), t.m(0,2), t.m(0,3),
+                                             t.m(1,0), t.m(1,1), t.m(1,2), t.m(1,3),
+                                             t.m(2,0), t.m(2,1), t.m(2,2), t.m(2,3), 1));
+        solids.push_back(solid);
+    }
+    profile_count("3d facade parts", flat.parts.size());
+    
+    return union_reduce(solids);
+}
 
 //------------------------------POLYHEDRON FUNCTIONS--------------------------
 
 //This section handles all the code related to creating polyhedrons.
 
 //This function generates a cube polyhedron of the width defined below,
-//and saves it as a Nef_polyhedron nef_org (global variable).
+//and saves it as a Nef_polyhedron nef_org (global variable), along with the
+//cube of each other backend.
 void gen_poly(){
     poly_org_width = poly_org_width/2;
     
-    std::string str_width = std::to_string(poly_org_width);
-    
-    //The below declares the string which contains the various sides (triangular)
-    //as well as the coordinates of each vertex.
-    std::string input =
-    "OFF\n\
-    8 12 0\n\
-    -X -X -X\n\
-    -X X -X\n\
-    X X -X\n\
-    X -X -X\n\
-    -X -X X\n\
-    -X X X\n\
-    X X X\n\
-    X -X X\n\
-    3  0 1 3\n\
-    3  3 1 2\n\
-    3  0 4 1\n\
-    3  1 4 5\n\
-    3  3 2 7\n\
-    3  7 2 6\n\
-    3  4 0 3\n\
-    3  7 4 3\n\
-    3  6 4 7\n\
-    3  6 5 4\n\
-    3  1 5 6\n\
-    3  2 1 6";
-    
-    //The below replaces every X with the actual value.
-    while(input.find('X')!=std::string::npos){
-        input.replace(input.find('X'), 1, str_width);
-    }
-    
-    //Converts the string to a polyhedron.
-    std::stringstream ss;
-    ss << input;
-    ss >> poly_org;
-    
-    Nef_polyhedron nef(poly_org);
-    nef_org = nef;
+    Mesh_builder cube_mesh = box_mesh(poly_org_width*2, poly_org_width*2, poly_org_width*2);
+    nef_org = mesh_solid<Nef_polyhedron>(cube_mesh);
+    fast_cube_org = mesh_solid<Fast_solid>(cube_mesh);
+    csg_cube_org = csg_primitive(nef_org);
+    lazy_cube_org = Lazy_nef(nef_org);
+    flat_cube_org = flat_box(-poly_org_width, -poly_org_width, -poly_org_width, poly_org_width, poly_org_width, poly_org_width);
 }
 
+//These return the cube and cylinder templates of each backend.
+template<class Solid> const Solid& cube_org();
+template<> const Nef_polyhedron& cube_org<Nef_polyhedron>(){ return nef_org; }
+template<> const Fast_solid& cube_org<Fast_solid>(){ return fast_cube_org; }
+template<> const Csg_solid& cube_org<Csg_solid>(){ return csg_cube_org; }
+template<> const Lazy_nef& cube_org<Lazy_nef>(){ return lazy_cube_org; }
+template<> const Flat_solid& cube_org<Flat_solid>(){ return flat_cube_org; }
+
+template<class Solid> const Solid& cylinder_template();
+template<> const Nef_polyhedron& cylinder_template<Nef_polyhedron>(){ return cylinder_org; }
+template<> const Fast_solid& cylinder_template<Fast_solid>(){ return fast_cylinder_org; }
+template<> const Csg_solid& cylinder_template<Csg_solid>(){ return csg_cylinder_org; }
+template<> const Lazy_nef& cylinder_template<Lazy_nef>(){ return lazy_cylinder_org; }
+template<> const Flat_solid& cylinder_template<Flat_solid>(){ return flat_cylinder_org; }
+
 //This function is called whenever a cube is created. Here, it uses the
 //nef_org cube declared globally as a template and transforms it by the width.
-Nef_polyhedron cube(double width){//change int to double
-    Nef_polyhedron nef = nef_org;
+template<class Solid>
+Solid cube(double width){//change int to double
+    Solid nef = cube_org<Solid>();
     scale(width/poly_org_width/2, width/poly_org_width/2, width/poly_org_width/2, nef);
     
     return nef;
@@ -208,8 +1672,9 @@ Nef_polyhedron cube(double width){//change int to double
 
 //This function is called whenever a square is created. Here, it uses the
 //nef_org cube declared globally as a template and transforms it by the width and length.
-Nef_polyhedron square(double width, double length){//change int to double
-    Nef_polyhedron nef = nef_org;
+template<class Solid>
+Solid square(double width, double length){//change int to double
+    Solid nef = cube_org<Solid>();
     scale(width/poly_org_width/2, length/poly_org_width/2, 1/poly_org_width/2, nef);
     
     return nef;
@@ -224,113 +1689,273 @@ void hull(Polyhedron_3& poly, double coord[][3], int size){
     
     //The below converts the array into a vector point 3 object.
     for(int i =0; i<size; i++){
-        points.push_back(Point_3(coord[i][0],coord[i][1],coord[i][2]));
+        points.push_back(Point_3(snap(coord[i][0]),snap(coord[i][1]),snap(coord[i][2])));
     }
     
     //computes convex hull for the polyhedorn.
     CGAL::convex_hull_3(points.begin(), points.end(), poly);
     
-    Surface_mesh sm;
-    CGAL::convex_hull_3(points.begin(), points.end(), sm);
+}
+
+//These create a solid of each backend from the convex hull of the coord array.
+template<class Solid> Solid hull_solid(double coord[][3], int size);
+
+template<> Nef_polyhedron hull_solid<Nef_polyhedron>(double coord[][3], int size){
+    Polyhedron_3 polygon;
+    hull(polygon, coord, size);
+    return Nef_polyhedron(polygon);
+}
+
+template<> Csg_solid hull_solid<Csg_solid>(double coord[][3], int size){
+    return csg_primitive(hull_solid<Nef_polyhedron>(coord, size));
+}
+
+template<> Lazy_nef hull_solid<Lazy_nef>(double coord[][3], int size){
+    return Lazy_nef(hull_solid<Nef_polyhedron>(coord, size));
+}
+
+template<> Fast_solid hull_solid<Fast_solid>(double coord[][3], int size){
+    std::vector<Fast_kernel::Point_3> points;
+    for(int i =0; i<size; i++){
+        points.push_back(Fast_kernel::Point_3(snap(coord[i][0]),snap(coord[i][1]),snap(coord[i][2])));
+    }
     
+    Fast_solid solid;
+    solid.parts.push_back(Fast_mesh());
+    CGAL::convex_hull_3(points.begin(), points.end(), solid.parts[0]);
+    return solid;
 }
 
-//This function makes use of the hull function from above. It takes a width, height
-//and sides as input and uses these to create a n sided polygon.
-Nef_polyhedron polygon(double circumradius_addition, double width, double height, int sides){
+//This function creates a n sided polygon prism. It takes a width, height
+//and sides as input and builds the prism directly.
+template<class Solid>
+Solid polygon(double circumradius_addition, double width, double height, int sides){
     
     //Note: circumradius_addition is the amount to add to the width of the shape
     //For use with the overhangs.
-    double sin_x =sin((180/sides)*PI/180);
-    double circumradius = width/(2*sin_x)+circumradius_addition;//Length to vertex
-    double sum_angle = (sides-2)*180;
-    double side_angle = sum_angle/sides;
-    
-    double coord[sides*2][3];
-    
-    //This computes each coordinate and adds it to the list. Note the two coord sets below.
-    //each one stores the top and bottom of the vertex.
-    for(int i =0; i<sides;i++){
-        double x  = circumradius*cos(((180-side_angle)*i)*PI/180);
-        double y  = circumradius*sin(((180-side_angle)*i)*PI/180);
-        
-        coord[i*2][0]= x;
-        coord[i*2][1]= y;
-        coord[i*2][2]= height/2;
-        
-        coord[i*2+1][0]= x;
-        coord[i*2+1][1]= y;
-        coord[i*2+1][2]= -height/2;
-    }
-    
-    Polyhedron_3 polygon;
-    
-    hull(polygon, coord, sides*2);
-    Nef_polyhedron nef_polygon(polygon);
-    
-    return nef_polygon;
+    return mesh_solid<Solid>(prism_mesh(polygon_outline(circumradius_addition, width, sides), -height/2, height/2));
 }
 
 //This creates the global cylinder to be used with all cylinders later on.
 void gen_cylinder(double height, int sides){
     
-    
-    double circumradius = 1;//Length to vertex
-    double sum_angle = (sides-2)*180;
-    double side_angle = sum_angle/sides;
-    
-    double coord[sides*2][3];// = {{-10,-10,0},{10,-10,0},{-10,10,0},{10,10,0},{0,0,10}};
-    
-    for(int i =0; i<sides;i++){
-        double x  = circumradius*cos(((180-side_angle)*i)*PI/180);
-        double y  = circumradius*sin(((180-side_angle)*i)*PI/180);
-        
-        coord[i*2][0]= x;
-        coord[i*2][1]= y;
-        coord[i*2][2]= height/2;
-        
-        coord[i*2+1][0]= x;
-        coord[i*2+1][1]= y;
-        coord[i*2+1][2]= -height/2;
-        
-    }
-    
-    Polyhedron_3 polygon;
-    
-    hull(polygon, coord, sides*2);
-    Nef_polyhedron nef(polygon);
-    cylinder_org =  nef;
+    Mesh_builder cylinder_mesh = prism_mesh(regular_outline(1, sides), -height/2, height/2);
+    cylinder_org = mesh_solid<Nef_polyhedron>(cylinder_mesh);
+    fast_cylinder_org = mesh_solid<Fast_solid>(cylinder_mesh);
+    csg_cylinder_org = csg_primitive(cylinder_org);
+    lazy_cylinder_org = Lazy_nef(cylinder_org);
+    flat_cylinder_org = mesh_solid<Flat_solid>(cylinder_mesh);
     
 }
+//The cylinders with fewer sides (used by the lower levels of detail) are built the first time they're
+//used, and kept as templates like the cylinder_org.
+template<class Solid>
+const Solid& cylinder_template(int sides){
+    if(sides==fn) return cylinder_template<Solid>();
+    
+    static std::mutex lock;
+    static std::map<int, Solid> templates;
+    std::lock_guard<std::mutex> guard(lock);
+    typename std::map<int, Solid>::iterator it = templates.find(sides);
+    if(it==templates.end())
+        it = templates.insert(std::make_pair(sides, mesh_solid<Solid>(prism_mesh(regular_outline(1, sides), -0.5, 0.5)))).first;
+    return it->second;
+}
+
 //This is called whenever a cylinder is meant to be created. It uses the cylinder_org global
-//polyhedron as a template and transforms it by the height.
-Nef_polyhedron cylinder(double height){
-    Nef_polyhedron nef = cylinder_org;
+//polyhedron (or the template with the given amount of sides) and transforms it by the height.
+template<class Solid>
+Solid cylinder(double height, int sides = fn){
+    Solid nef = cylinder_template<Solid>(sides);
     scale(0.5, 0.5, height/2, nef);
     
     return nef;
 }
 
+//------------------------------INSTANCING--------------------------
+
+//This section handles the instancing mode. Instead of unioning a copy of the window tile for every
+//x in the row, the tile is computed once as a prototype and each placement only records its
+//transformation. The instances are expanded into mesh vertices when the file is written.
+
+template<class Solid>
+struct Instance{
+    std::shared_ptr<const Solid> prototype;
+    typename Solid::Aff_transformation_3 transformation;
+};
+
+//An Assembly is a solid along with the instances placed onto it.
+template<class Solid>
+struct Assembly{
+    Solid nef;
+    std::vector<Instance<Solid> > instances;
+};
+typedef Assembly<Nef_polyhedron> Nef_assembly;
+
+//The below transform the solid as well as every instance of the assembly.
+template<class Solid>
+void translate(double transl_x, double transl_y, double transl_z, Assembly<Solid>& assembly){
+    typedef typename Solid::Aff_transformation_3 Aff_transformation_3;
+    translate(transl_x, transl_y, transl_z, assembly.nef);
+    
+    Aff_transformation_3 transl = translation<Solid>(transl_x, transl_y, transl_z);
+    for(std::size_t i = 0; i<assembly.instances.size(); i++)
+        assembly.instances[i].transformation = transl*assembly.instances[i].transformation;
+}
+
+template<class Solid>
+void rotate(double rotate_x, double rotate_y, double rotate_z, Assembly<Solid>& assembly){
+    typedef typename Solid::Aff_transformation_3 Aff_transformation_3;
+    rotate(rotate_x, rotate_y, rotate_z, assembly.nef);
+    
+    Aff_transformation_3 rot = rotation<Aff_transformation_3>(rotate_x, rotate_y, rotate_z);
+    for(std::size_t i = 0; i<assembly.instances.size(); i++)
+        assembly.instances[i].transformation = rot*assembly.instances[i].transformation;
+}
+
+template<class Solid>
+Assembly<Solid>& operator+=(Assembly<Solid>& assembly, const Solid& nef){
+    assembly.nef+=nef;
+    return assembly;
+}
+
+template<class Solid>
+void count_merge(const Assembly<Solid>& assembly){
+    count_merge(assembly.nef);
+}
+
+template<class Solid>
+Assembly<Solid>& operator+=(Assembly<Solid>& assembly, const Assembly<Solid>& other){
+    assembly.nef+=other.nef;
+    assembly.instances.insert(assembly.instances.end(), other.instances.begin(), other.instances.end());
+    return assembly;
+}
+
+//------------------------------PROTOTYPE CACHE--------------------------
+
+//The windows, doors and railings are generated with the same parameters over and over (on every
+//side, every centre row, and every building in a batch). The cache below keeps each generated
+//prototype, keyed by its kind, design number and dimensions, so it is only generated once per run.
+//The dimensions are quantized to 1/cache_quantum of a unit, so tiny floating point differences
+//still find the same prototype. As random dimensions rarely repeat between buildings, each cache keeps
+//at most prototype_cache_limit prototypes, and removes the least recently used past that.
+
+enum Prototype_kind{ PROTOTYPE_WINDOW, PROTOTYPE_DOOR, PROTOTYPE_RAILING };
+
+struct Prototype_key{
+    int kind;
+    int design;
+    std::vector<long long> dimensions;
+    
+    bool operator<(const Prototype_key& other) const{
+        if(kind!=other.kind) return kind<other.kind;
+        if(design!=other.design) return design<other.design;
+        return dimensions<other.dimensions;
+    }
+};
+
+//Each backend has its own cache, shared by every thread. Each entry keeps its place in the list of
+//uses, which goes from the most to the least recently used key.
+template<class Solid>
+struct Prototype_cache{
+    struct Entry{
+        std::shared_ptr<const Solid> prototype;
+        std::list<Prototype_key>::iterator use;
+    };
+    static std::mutex lock;
+    static std::map<Prototype_key, Entry> entries;
+    static std::list<Prototype_key> uses;
+    
+    static void clear(){
+        std::lock_guard<std::mutex> guard(lock);
+        entries.clear();
+        uses.clear();
+    }
+};
+template<class Solid> std::mutex Prototype_cache<Solid>::lock;
+template<class Solid> std::map<Prototype_key, typename Prototype_cache<Solid>::Entry> Prototype_cache<Solid>::entries;
+template<class Solid> std::list<Prototype_key> Prototype_cache<Solid>::uses;
+
+//This returns the cached prototype, or generates it with build and adds it to the cache.
+//The prototype is generated outside of the lock, so other threads can keep using the cache.
+template<class Solid, class Build>
+Solid cached_prototype(int kind, int design, std::initializer_list<double> dimensions, Build build){
+    if(!prototype_caching) return build();
+    
+    Prototype_key key;
+    key.kind = kind;
+    key.design = design;
+    for(double dimension : dimensions)
+        key.dimensions.push_back(llround(dimension*cache_quantum));
+    
+    {
+        std::lock_guard<std::mutex> lock(Prototype_cache<Solid>::lock);
+        typename std::map<Prototype_key, typename Prototype_cache<Solid>::Entry>::iterator it = Prototype_cache<Solid>::entries.find(key);
+        if(it!=Prototype_cache<Solid>::entries.end()){
+            prototype_cache_hits++;
+            Prototype_cache<Solid>::uses.splice(Prototype_cache<Solid>::uses.begin(), Prototype_cache<Solid>::uses, it->second.use);
+            return *it->second.prototype;
+        }
+    }
+    
+    prototype_cache_misses++;
+    std::shared_ptr<const Solid> prototype = std::make_shared<const Solid>(build());
+    
+    //Another thread may have added the same prototype meanwhile, in which case its entry is kept.
+    std::lock_guard<std::mutex> lock(Prototype_cache<Solid>::lock);
+    typename Prototype_cache<Solid>::Entry entry = {prototype, Prototype_cache<Solid>::uses.end()};
+    std::pair<typename std::map<Prototype_key, typename Prototype_cache<Solid>::Entry>::iterator, bool> inserted = Prototype_cache<Solid>::entries.insert(std::make_pair(key, entry));
+    if(inserted.second){
+        Prototype_cache<Solid>::uses.push_front(key);
+        inserted.first->second.use = Prototype_cache<Solid>::uses.begin();
+    }
+    while(Prototype_cache<Solid>::entries.size()>prototype_cache_limit){
+        Prototype_cache<Solid>::entries.erase(Prototype_cache<Solid>::uses.back());
+        Prototype_cache<Solid>::uses.pop_back();
+        prototype_cache_evictions++;
+    }
+    return *prototype;
+}
+
 //------------------------------WINDOW GRAMMAR--------------------------
 
+//The windows and doors are generated at a level of detail (see --lod): 3 is the full design, 2 drops the
+//small parts of each design and uses cylinders with lod_fn sides, and 1 only places a flat panel of the
+//window's size on the wall. Level 0 has no facades at all.
+
+//This returns the amount of sides of the cylinders at the level of detail.
+int lod_sides(int lod){
+    return lod>=3 ? fn : std::min(fn, lod_fn);
+}
+
+//This function generates the flat panel which stands in for a window or door at level of detail 1.
+template<class Solid>
+Solid gen_panel(double panel_width, double panel_height){
+    Solid nef = square<Solid>(1, panel_width);
+    scale(1,1,panel_height, nef);
+    translate(-0.5,0,0, nef);
+    return nef;
+}
+
 //This function generates a simple door.
-Nef_polyhedron gen_door(double door_width, double door_height, double tile_width, double tile_height, double bottom_height){
+template<class Solid>
+Solid gen_door(double door_width, double door_height, double tile_width, double tile_height, double bottom_height, int lod){
     
-    Nef_polyhedron nef_square1 = square(1, door_width*1.2);
+    Solid nef_square1 = square<Solid>(1, door_width*1.2);
     translate(1,0,door_height/2-(tile_height/2-door_height/2)*0.7, nef_square1);
     
-    Nef_polyhedron nef_square2 = square(1,door_width*1.5);
+    Solid nef_square2 = square<Solid>(1,door_width*1.5);
     scale(20,1,10, nef_square2);
     translate(1,0,door_height/2-(tile_height/2-door_height/2), nef_square2);
     
-    Nef_polyhedron nef = nef_square2;
+    Solid nef = nef_square2;
     
-    Nef_polyhedron nef_cylinder = cylinder(door_height*2);
+    Solid nef_cylinder = cylinder<Solid>(door_height*2, lod_sides(lod));
     scale(20,20,1,nef_cylinder);
     
-    Nef_polyhedron railings;
+    Solid railings;
     for(int i = 0; i<=1; i++){
-        Nef_polyhedron nef_loop = nef_cylinder;
+        Solid nef_loop = nef_cylinder;
         translate(10,(door_width/2*1.2-door_width*i*1.2),-(tile_height/2-door_height/2), nef_loop);
         railings+=nef_loop;
         
@@ -344,57 +1969,58 @@ Nef_polyhedron gen_door(double door_width, double door_height, double tile_width
 //The below set of functions contains five different window fuctions, each creating a unique window
 //design and returning it as a Nef_polyhedron.
 
-Nef_polyhedron gen_window_1(double window_width, double window_height){
+template<class Solid>
+Solid gen_window_1(double window_width, double window_height, int lod){
     
-    Nef_polyhedron square1 = square(1, window_width*1.5);
+    Solid square1 = square<Solid>(1, window_width*1.5);
     scale(20,1,5, square1);
     translate(-1,0,-window_height/2, square1);
     
-    Nef_polyhedron square2 = square(1, window_width*1.5);
+    Solid square2 = square<Solid>(1, window_width*1.5);
     scale(10,1,5, square2);
     translate(-1,0,window_height/2, square2);
     
-    Nef_polyhedron square3 = square(1, window_width);
+    Solid square3 = square<Solid>(1, window_width);
     scale(5,1,3, square3);
     translate(-1,0,0, square3);
     
-    Nef_polyhedron nef =square1+square2+square3;
+    std::vector<Solid> parts = {square1, square2};
+    if(lod>=3) parts.push_back(square3);
     
-    Nef_polyhedron nef_cylinder = cylinder(window_height*2);
+    Solid nef_cylinder = cylinder<Solid>(window_height*2, lod_sides(lod));
     scale(5,5,1,nef_cylinder);
     
     for(int i = 0; i<=1; i++){
-        Nef_polyhedron nef_loop =  nef_cylinder;
+        Solid nef_loop =  nef_cylinder;
         translate(-1,window_width/2-window_width*i,0, nef_loop);
-        nef+=nef_loop;
+        parts.push_back(nef_loop);
     }
     
-    return nef;
+    return union_reduce(parts);
 }
 
-Nef_polyhedron gen_window_2(double window_width, double window_height){
+template<class Solid>
+Solid gen_window_2(double window_width, double window_height, int lod){
     
-    Nef_polyhedron nef;
-    
-    
-    Nef_polyhedron nef1 = square(1, window_width*1.5);
+    Solid nef1 = square<Solid>(1, window_width*1.5);
     scale(2, 1, 0.5, nef1);
     translate(-2, 0, -window_height/2, nef1);
     
-    Nef_polyhedron nef2 = square(1, window_width*1.5);
+    Solid nef2 = square<Solid>(1, window_width*1.5);
     scale(1,1,0.5, nef2);
     translate(-2, 0, window_height/2, nef2);
     
-    Nef_polyhedron nef3=cube(window_height);
+    Solid nef3=cube<Solid>(window_height);
     scale(0.1,0.1,1, nef3);
     translate(-2, 0,0, nef3);
-    nef = nef1+nef2+nef3;
+    std::vector<Solid> parts = {nef1, nef2};
+    if(lod>=3) parts.push_back(nef3);
     
-    Nef_polyhedron nef4 = cube(window_height);
+    Solid nef4 = cube<Solid>(window_height);
     scale(0.1,0.15,1, nef4);
     translate(-1,window_width/2*1.2,0, nef4);
     
-    Nef_polyhedron nef5 = square(1, window_width);
+    Solid nef5 = square<Solid>(1, window_width);
     scale(0.5,1,2, nef5);
     translate(-2,0,window_height/2*0.3, nef5);
     
@@ -402,64 +2028,72 @@ Nef_polyhedron gen_window_2(double window_width, double window_height){
         rotate(static_cast<double>(180*i), 0, 0, nef4);
         rotate(static_cast<double>(180*i), 0, 0, nef5);
         
-        nef+=(nef4+nef5);
+        parts.push_back(nef4);
+        if(lod>=3) parts.push_back(nef5);
         
     }
     
-    return nef;
+    return union_reduce(parts);
 }
 
-Nef_polyhedron gen_window_3(double window_width, double window_height){
+template<class Solid>
+Solid gen_window_3(double window_width, double window_height, int lod){
     
-    Nef_polyhedron square1 = square(1, window_width*1.2);
+    Solid square1 = square<Solid>(1, window_width*1.2);
     scale(30,1,10, square1);
     translate(-1,0,-window_height/2*1.15, square1);
     
-    Nef_polyhedron square2 = square(1, window_width*1.3);
+    Solid square2 = square<Solid>(1, window_width*1.3);
     scale(50,1,10, square2);
     translate(-1,0,-window_height/2, square2);
     
-    Nef_polyhedron square3 = square(1, window_width*1.3);
+    Solid square3 = square<Solid>(1, window_width*1.3);
     scale(1,1,0.5, square3);
     translate(-1,0,window_height/2, square3);
     
-    Nef_polyhedron square4 = square(1, window_width);
+    Solid square4 = square<Solid>(1, window_width);
     scale(4.5,1,2, square4);
     translate(-1,0,window_height/2*0.2, square4);
     
-    Nef_polyhedron square5 = square(window_width, window_width);
+    Solid square5 = square<Solid>(window_width, window_width);
     scale(0.5,1.6,10, square5);
     translate(40,0,window_height/2, square5);
     rotate(0,-45,0, square5);
     
     
-    Nef_polyhedron cube1 = cube(window_height);
+    Solid cube1 = cube<Solid>(window_height);
     scale(0.1,0.1,0.6, cube1);
     translate(-1,0,-window_height/5, cube1);
     
-    Nef_polyhedron nef =square1+square2+square3+square4+square5+cube1;
+    std::vector<Solid> parts = {square1, square2, square3};
+    if(lod>=3){
+        parts.push_back(square4);
+        parts.push_back(square5);
+        parts.push_back(cube1);
+    }
     
-    Nef_polyhedron cube2 = cube(window_height);
+    Solid cube2 = cube<Solid>(window_height);
     scale(0.3,0.15,1, cube2);
     translate(-1,window_width/2*1.2,0, cube2);
     
     for(int i = 0; i<=1;i++){
         rotate(180*i,0,0, cube2);
-        nef+=cube2;
+        parts.push_back(cube2);
     }
     
-    return nef;
+    return union_reduce(parts);
     
 }
 
-Nef_polyhedron gen_window_4(double window_width, double window_height){
-    Nef_polyhedron nef;
+template<class Solid>
+Solid gen_window_4(double window_width, double window_height, int lod){
+    std::vector<Solid> parts;
     
-    Nef_polyhedron nef_cylinder = cylinder(window_height*2);
+    Solid nef_cylinder = cylinder<Solid>(window_height*2, lod_sides(lod));
     scale(5,5,1,nef_cylinder);
     translate(-0.5,window_width/2,0, nef_cylinder);
     
-    Nef_polyhedron nef_square = square(15, window_width);
+    Solid nef_square = square<Solid>(15, window_width);
     scale(1,1,4, nef_square);
     translate(0,0,window_height/2, nef_square);
     
@@ -467,118 +2101,117 @@ Nef_polyhedron gen_window_4(double window_width, double window_height){
         
         rotate(static_cast<double>(180*i),0,0, nef_cylinder);
         rotate(0, static_cast<double>(180*i), 0, nef_square);
-        nef+=(nef_square+nef_cylinder);
+        parts.push_back(nef_square);
+        parts.push_back(nef_cylinder);
     }
-    return nef;
+    return union_reduce(parts);
 }
 
-Nef_polyhedron gen_window_5(double window_width, double window_height){
+template<class Solid>
+Solid gen_window_5(double window_width, double window_height, int lod){
     
     
-    Nef_polyhedron square1 = square(1, window_width);
+    Solid square1 = square<Solid>(1, window_width);
     scale(10,1,3, square1);
     translate(-0.5,0,window_height*1.35/4, square1);
     
-    Nef_polyhedron square2 = square(1, window_width*1.2);
+    Solid square2 = square<Solid>(1, window_width*1.2);
     scale(25,1,5, square2);
     translate(-1,0,window_height*1.35/10-window_height*1.35/4, square2);
     
-    Nef_polyhedron square3 = square(1, window_width*1.2);
+    Solid square3 = square<Solid>(1, window_width*1.2);
     scale(20,1,7, square3);
     translate(-1,0,window_height*1.35/10+window_height*1.35/4, square3);
     
-    Nef_polyhedron square4 = square(1, window_width);
+    Solid square4 = square<Solid>(1, window_width);
     scale(4,1,1, square4);
     translate(-0.3,0,window_height*1.35/12, square4);
     
-    Nef_polyhedron square5 = square(1, window_width);
+    Solid square5 = square<Solid>(1, window_width);
     scale(4,1,1, square5);
     translate(-0.3,0,-window_height*1.35/12, square5);
     
-    Nef_polyhedron cylinder1 = cylinder(window_height);
+    Solid cylinder1 = cylinder<Solid>(window_height, lod_sides(lod));
     scale(5,5,1.35, cylinder1);
     
-    Nef_polyhedron cylinder2 = cylinder(window_height);
+    Solid cylinder2 = cylinder<Solid>(window_height, lod_sides(lod));
     scale(2,2,1, cylinder2);
     translate(-0.5,window_width*0.3,window_height*1.35/20, cylinder2);
     
-    Nef_polyhedron nef =square1+square2+square3+square4+square5;
+    std::vector<Solid> parts = {square1, square2, square3};
+    if(lod>=3){
+        parts.push_back(square4);
+        parts.push_back(square5);
+    }
     
     for(int i = 0; i<=1; i++){
-        Nef_polyhedron nef_loop = cylinder1;
+        Solid nef_loop = cylinder1;
         translate(-0.5,window_width/2-window_width*i,window_height*1.35/10, nef_loop);
         rotate(0,0,180*i, cylinder2);
-        nef+=nef_loop+cylinder2;
+        parts.push_back(nef_loop);
+        if(lod>=3) parts.push_back(cylinder2);
+    }
+    return union_reduce(parts);
+    
+}
+
+
+//This returns the window design of the row grid_y.
+int window_design(double window_scale_parameters[], double window_design_parameters[], int grid_y, int grid_height){
+    //This is a style rule. If the window scale is 1 (meaning it takes up the entire tile), the program
+    //sets the window style to 4.
+    if( (window_scale_parameters[0] == 1 && grid_y == 0) || (window_scale_parameters[2] == 1 && grid_y >0 && grid_y<grid_height-1) || (window_scale_parameters[0] == 1 && grid_y == grid_height-1)){
+        return 1;
     }
-    return nef;
     
+    //This is used for everything else
+    if(grid_y==0) return window_design_parameters[0];
+    else if(grid_y==grid_height-1) return window_design_parameters[1];
+    else return window_design_parameters[2];
 }
 
-
 //this function calls the specific window generation function based on the window type chosen.
-Nef_polyhedron gen_windows(double window_width, int window_op, double tile_width,double window_height, double tile_height){
-    Nef_polyhedron nef;
-    
-    if(window_op==1)     nef = gen_window_1(window_width, window_height);
-    else if(window_op==2)nef = gen_window_2(window_width, window_height);
-    else if(window_op==3)nef = gen_window_3(window_width, window_height);
-    else if(window_op==4)nef = gen_window_4(window_width, window_height);
-    else if(window_op==5)nef = gen_window_5(window_width, window_height);
+template<class Solid>
+Solid gen_windows(double window_width, int window_op, double tile_width,double window_height, double tile_height, int lod){
+    Solid nef;
+    
+    if(lod<=1)           nef = gen_panel<Solid>(window_width, window_height);
+    else if(window_op==1)    nef = gen_window_1<Solid>(window_width, window_height, lod);
+    else if(window_op==2)nef = gen_window_2<Solid>(window_width, window_height, lod);
+    else if(window_op==3)nef = gen_window_3<Solid>(window_width, window_height, lod);
+    else if(window_op==4)nef = gen_window_4<Solid>(window_width, window_height, lod);
+    else if(window_op==5)nef = gen_window_5<Solid>(window_width, window_height, lod);
     return nef;
     
 }
 //This function generates the window style based upon the y row, then calls the gen_windows function.
-Nef_polyhedron window_grammar(int shape_type, double window_scale_parameters[], double window_design_parameters[], double window_width, double window_height, double tile_width, double tile_height, int grid_y, int grid_height){
-    
+template<class Solid>
+Solid window_grammar(int shape_type, double window_scale_parameters[], double window_design_parameters[], double window_width, double window_height, double tile_width, double tile_height, int grid_y, int grid_height, int lod){
+    Stage_timer timer("window_grammar");
     
-    Nef_polyhedron nef;
+    int window_op = window_design(window_scale_parameters, window_design_parameters, grid_y, grid_height);
     
-    //This is a style rule. If the window scale is 1 (meaning it takes up the entire tile), the program
-    //sets the window style to 4.
-    if( (window_scale_parameters[0] == 1 && grid_y == 0) || (window_scale_parameters[2] == 1 && grid_y >0 && grid_y<grid_height-1) || (window_scale_parameters[0] == 1 && grid_y == grid_height-1)){
-        Nef_polyhedron nef_window = gen_windows(window_width,  1, tile_width, window_height, tile_height);
+    //The window (rotated for the polygon) is taken from the prototype cache if it was already generated.
+    return cached_prototype<Solid>(PROTOTYPE_WINDOW, window_op, {window_width, window_height, static_cast<double>(shape_type==2), static_cast<double>(lod)}, [&](){
+        Solid nef_window = gen_windows<Solid>(window_width,  window_op, tile_width, window_height, tile_height, lod);
         if(shape_type==2)
             rotate(0,0,180, nef_window);
-        nef+=nef_window;
-        
-    }
-    else{
-        //This is used for everything else
-        if(grid_y==0){
-            Nef_polyhedron nef_window = gen_windows(window_width,  window_design_parameters[0], tile_width, window_height, tile_height);
-            if(shape_type==2)
-                rotate(0,0,180, nef_window);
-            nef+=nef_window;
-        }
-        else if(grid_y==grid_height-1){
-            Nef_polyhedron nef_window = gen_windows(window_width,  window_design_parameters[1], tile_width, window_height, tile_height);
-            if(shape_type==2)
-                rotate(0,0,180, nef_window);
-            nef+=nef_window;
-        }
-        else{
-            Nef_polyhedron nef_window = gen_windows(window_width,  window_design_parameters[2], tile_width, window_height, tile_height);
-            if(shape_type==2)
-                rotate(0,0,180, nef_window);
-            nef+=nef_window;
-        }
-    }
-    
-    return nef;
-    
+        return nef_window;
+    });
     
 }
 
 //This function generates the railing by creating it in two steps. One is the bottom and the other the top, where the
 //size is based upon the tile sizes and the railing scales.
 
-Nef_polyhedron gen_railing(double tile_width, double tile_height, double railing_scale, double width){
-    Nef_polyhedron nef;
+template<class Solid>
+Solid gen_railing(double tile_width, double tile_height, double railing_scale, double width){
+    Solid nef;
     
-    Nef_polyhedron nef_top = square(tile_height/5, width);
+    Solid nef_top = square<Solid>(tile_height/5, width);
     rotate(90,90,90,nef_top);
     
-    Nef_polyhedron nef_bottom = nef_top;
+    Solid nef_bottom = nef_top;
     scale(railing_scale,1,1, nef_top);
     translate(1,0,tile_height/2-tile_height/5, nef_top);
     
@@ -593,9 +2226,45 @@ Nef_polyhedron gen_railing(double tile_width, double tile_height, double railing
 
 //------------------------------FACADE GRAMMAR--------------------------
 
+//A Facade_spec is compiled once for each side of the building (by facade_spec, below) from the door,
+//removed windows and railings, so gen_level looks up each tile and row instead of scanning the parameter
+//lists, which are no longer copied into every call. It isn't changed once compiled, and is passed by
+//const reference. The tiles are stored by row (y*row_width+x).
+struct Facade_spec{
+    std::array<int, 3> grid_widths; //The bottom, centre and top grid widths of the side.
+    int grid_height;
+    int row_width; //The widest of the grid widths.
+    std::vector<bool> door; //If the tile is the door.
+    std::vector<bool> removed; //If the tile's window is removed.
+    std::vector<bool> railing; //If the row has a railing, and its size.
+    std::vector<int> railing_size;
+    int lod; //The level of detail of the facade.
+    Tile_counts* counts; //The tiles placed on the side are counted here, if it isn't NULL (not part of the spec).
+    
+    bool has_door(int x, int y) const{
+        return contains(x, y) && door[y*row_width+x];
+    }
+    bool is_removed(int x, int y) const{
+        return contains(x, y) && removed[y*row_width+x];
+    }
+    bool has_railing(int y) const{
+        return y>=0 && y<grid_height && railing[y];
+    }
+    bool contains(int x, int y) const{
+        return x>=0 && x<row_width && y>=0 && y<grid_height;
+    }
+    
+    //Specs are ordered so that sides with the same spec can share their facade.
+    bool operator<(const Facade_spec& other) const{
+        return std::tie(grid_widths, grid_height, door, removed, railing, railing_size, lod) < std::tie(other.grid_widths, other.grid_height, other.door, other.removed, other.railing, other.railing_size, other.lod);
+    }
+};
+
 //This function generates the facade row and tiles. It does so by looping through the row, and generating a
 //tile where a window is placed.
-Nef_polyhedron gen_level(std::vector<std::vector <int> > remove_windows,double window_scale_parameters[], double door_parameters[], double grid_bottom_parameters[], double grid_center_parameters[], double grid_top_parameters[], double window_design_parameters[], std::vector <std::vector <int> > railing_parameters, double coord[], double angle[], int grid_width, int grid_height, double width, double height, int shape_type, int door, int y, double width_scale, double height_scale, double vertical_offset, double bottom_height, int side){
+template<class Solid>
+Assembly<Solid> gen_level(const Facade_spec& spec,double window_scale_parameters[], double door_parameters[], double grid_bottom_parameters[], double grid_center_parameters[], double grid_top_parameters[], double window_design_parameters[], double coord[], double angle[], int grid_width, int grid_height, double width, double height, int shape_type, int y, double width_scale, double height_scale, double vertical_offset, double bottom_height, int side){
+    Stage_timer timer("gen_level");
     
     //The tile variables is the height/width of each tile or segment of the facade grid.
     double tile_height = (height-bottom_height*2)/grid_height;
@@ -609,125 +2278,213 @@ Nef_polyhedron gen_level(std::vector<std::vector <int> > remove_windows,double w
     double door_height = tile_height/door_parameters[2];
     double door_width = tile_width/door_parameters[1];
     
-    Nef_polyhedron nef;
-    Nef_polyhedron nef_windows;
-    
-    //This segment handles the railing generation. It does so by first looping through the
-    //railing parameter list and checking if the values stored match the y row of the facade
-    //(Or if the values are -1), then calls the gen_railing function.
-    
-    for(int i = 0; i<railing_parameters.size(); i++){
-        
-        if((side == railing_parameters[i][2] || railing_parameters[i][2] <0) && (y==railing_parameters[i][1] || railing_parameters[i][1] <0)){
-            Nef_polyhedron nef_railing =gen_railing(tile_width, tile_height, railing_parameters[i][0], width);
-            translate(0,(width/2),(tile_height/2+bottom_height*2+y*tile_height+vertical_offset), nef_railing);
-            nef+= nef_railing;
-            std::cout << "railing placed" << std::endl;
-            break;
-        }
+    Assembly<Solid> nef;
+    Solid nef_windows;
+    std::vector<Solid> tiles;
+    
+    //This segment handles the railing generation. The spec holds the railing of each row of the side
+    //(the first railing in the parameter list whose y matches the row, or is -1), which is passed to
+    //the gen_railing function.
+    
+    if(spec.has_railing(y)){
+        int railing_size = spec.railing_size[y];
+        Solid nef_railing = cached_prototype<Solid>(PROTOTYPE_RAILING, 0, {tile_height, static_cast<double>(railing_size), width}, [&](){
+            return gen_railing<Solid>(tile_width, tile_height, railing_size, width);
+        });
+        translate(0,(width/2),(tile_height/2+bottom_height*2+y*tile_height+vertical_offset), nef_railing);
+        nef+= nef_railing;
+        if(spec.counts) spec.counts->railings++;
+        Log_line(LOG_VERBOSE) << "railing placed";
     }
     
     //This segment is identical to the actual tile creation (Further below) but is modifed
     //to generate the bottom row height.
     if(y==0 && bottom_height>0){
         
-        nef_windows = window_grammar(shape_type,window_scale_parameters, window_design_parameters, window_width, bottom_window_height, tile_width, tile_height, y, grid_height);
+        nef_windows = window_grammar<Solid>(shape_type,window_scale_parameters, window_design_parameters, window_width, bottom_window_height, tile_width, tile_height, y, grid_height, spec.lod);
         translate(0, 0, -bottom_height*2+bottom_window_height/2, nef_windows);
         
     }
     //This creates the actual window for the entire row.
     else if(y>0){
-        nef_windows = window_grammar(shape_type, window_scale_parameters, window_design_parameters, window_width, window_height, tile_width, tile_height, y, grid_height);
+        nef_windows = window_grammar<Solid>(shape_type, window_scale_parameters, window_design_parameters, window_width, window_height, tile_width, tile_height, y, grid_height, spec.lod);
         translate(0, 0, vertical_offset, nef_windows);
         
     }
     
+    //In instancing mode, the row's window is shared by every tile as a prototype.
+    std::shared_ptr<const Solid> prototype;
+    if(instancing && !nef_windows.is_empty())
+        prototype = std::make_shared<const Solid>(nef_windows);
     
     for(int x =0; x<=grid_width-1; x++){
-        Nef_polyhedron nef_x;
+        Solid nef_x;
         
         //This segment checks if there is a door at the x, y value defined in the door_parameters list.
         //If there is, it creates a window for the door and calls the door function.
-        if(door == 0 && y==0 && ( x==door_parameters[0]) ){
-            nef_x= gen_door(door_width, door_height, tile_width, tile_height, bottom_height*2);
-            std::cout << "side: " << side << ", door_y: " << y << ", door_x: " << x << std::endl;
+        if(spec.has_door(x, y)){
+            nef_x= cached_prototype<Solid>(PROTOTYPE_DOOR, 0, {door_width, door_height, tile_height, bottom_height*2, static_cast<double>(spec.lod)}, [&](){
+                if(spec.lod<=1){
+                    Solid nef_panel = gen_panel<Solid>(door_width, door_height);
+                    translate(0,0,door_height/2-tile_height/2-bottom_height*2, nef_panel);
+                    return nef_panel;
+                }
+                return gen_door<Solid>(door_width, door_height, tile_width, tile_height, bottom_height*2, spec.lod);
+            });
+            if(spec.counts) spec.counts->doors++;
+            Log_line(LOG_VERBOSE) << "side: " << side << ", door_y: " << y << ", door_x: " << x;
             
         }
         else{
             
             //This checks if the window is to be removed.
-            bool remove_window = false;
-            for(int i = 0; i<remove_windows.size(); i++){
-                
-                if( (side==remove_windows[i][2] || remove_windows[i][2]<0) && (x==remove_windows[i][0] || remove_windows[i][0]<0) &&(y==remove_windows[i][1] || remove_windows[i][1]<0) ){
-                    remove_window= true;
-                    break;
-                }
+            bool remove_window = spec.is_removed(x, y);
+            if(!remove_window && prototype){//If instancing, the tile is only recorded as a placement.
+                Instance<Solid> instance;
+                instance.prototype = prototype;
+                instance.transformation = translation<Solid>(0, (tile_width/2+x*tile_width),(tile_height/2+bottom_height*2+y*tile_height));
+                nef.instances.push_back(instance);
+                if(spec.counts) spec.counts->windows++;
+                Log_line(LOG_VERBOSE) << "side: " << side << ", y: " << y << ", x: " << x;
+                continue;
             }
             if(!remove_window){//If the window isn't meant to be removed, it is set to the nef_x.
                 nef_x = nef_windows;
-                std::cout << "side: " << side << ", y: " << y << ", x: " << x << std::endl;
+                if(spec.counts && !nef_x.is_empty()) spec.counts->windows++;
+                Log_line(LOG_VERBOSE) << "side: " << side << ", y: " << y << ", x: " << x;
             }
+            else if(spec.counts) spec.counts->removed++;
         }
         
         translate(0, (tile_width/2+x*tile_width),(tile_height/2+bottom_height*2+y*tile_height), nef_x);
-        nef+= nef_x;
+        if(!nef_x.is_empty()) tiles.push_back(nef_x);
     }
     
+    nef+=union_reduce(tiles);
     return nef;
 }
 //This function splits the facade generation into its y components, meaning it generates the
 //bottom row first (y=0),then it moves to the center rows, then finally the top row.
 //This allows the bottom, center and top to each have different styles of windows available.
-Nef_polyhedron gen_facade(std::vector<std::vector <int> > remove_windows, double door_parameters[],double window_scale_parameters[], double window_design_parameters[], std::vector <std::vector <int> > railing_parameters, double coord[], double angle[], double grid_bottom_parameters[], double grid_center_parameters[], double grid_top_parameters[], double width, double height, int shape_type, int door, int side, double vertical_offset){
-    
-    Nef_polyhedron nef;
+template<class Solid>
+Assembly<Solid> gen_rows(const Facade_spec& spec, double door_parameters[],double window_scale_parameters[], double window_design_parameters[], double coord[], double angle[], double grid_bottom_parameters[], double grid_center_parameters[], double grid_top_parameters[], double width, double height, int shape_type, int side, double vertical_offset){
     int grid_height =grid_top_parameters[6];
     
-    nef+=gen_level(remove_windows, window_scale_parameters, door_parameters, grid_bottom_parameters, grid_center_parameters,  grid_top_parameters, window_design_parameters, railing_parameters, coord, angle, grid_bottom_parameters[side], grid_height, width, height, shape_type, door, 0, window_scale_parameters[0], window_scale_parameters[1], vertical_offset, grid_bottom_parameters[6], (side+1));
+    //Each row is generated as its own task, and the rows are merged afterwards. The top row
+    //is always stored last (as the bottom and top are both generated if the grid height is 1).
+    std::vector<Assembly<Solid> > levels(std::max(grid_height, 2));
+    Task_group group(task_pool);
     
-    for(int y =1; y<=grid_height-2; y++)
-        nef+=gen_level(remove_windows, window_scale_parameters, door_parameters, grid_bottom_parameters, grid_center_parameters,  grid_top_parameters, window_design_parameters, railing_parameters, coord, angle, grid_center_parameters[side], grid_height, width, height, shape_type, door, y, window_scale_parameters[2], window_scale_parameters[3], vertical_offset, grid_bottom_parameters[6], (side+1));
+    group.run([&](){
+        levels[0] = gen_level<Solid>(spec, window_scale_parameters, door_parameters, grid_bottom_parameters, grid_center_parameters,  grid_top_parameters, window_design_parameters, coord, angle, grid_bottom_parameters[side], grid_height, width, height, shape_type, 0, window_scale_parameters[0], window_scale_parameters[1], vertical_offset, grid_bottom_parameters[6], (side+1));
+    });
     
-    nef+=gen_level(remove_windows, window_scale_parameters, door_parameters, grid_bottom_parameters, grid_center_parameters,  grid_top_parameters, window_design_parameters, railing_parameters, coord, angle, grid_top_parameters[side], grid_height, width, height, shape_type, door, grid_height-1, window_scale_parameters[4], window_scale_parameters[5], vertical_offset, grid_bottom_parameters[6], (side+1));
+    for(int y =1; y<=grid_height-2; y++)
+        group.run([&, y](){
+            levels[y] = gen_level<Solid>(spec, window_scale_parameters, door_parameters, grid_bottom_parameters, grid_center_parameters,  grid_top_parameters, window_design_parameters, coord, angle, grid_center_parameters[side], grid_height, width, height, shape_type, y, window_scale_parameters[2], window_scale_parameters[3], vertical_offset, grid_bottom_parameters[6], (side+1));
+        });
     
+    group.run([&](){
+        levels.back() = gen_level<Solid>(spec, window_scale_parameters, door_parameters, grid_bottom_parameters, grid_center_parameters,  grid_top_parameters, window_design_parameters, coord, angle, grid_top_parameters[side], grid_height, width, height, shape_type, grid_height-1, window_scale_parameters[4], window_scale_parameters[5], vertical_offset, grid_bottom_parameters[6], (side+1));
+    });
+    group.wait();
     
-    translate(coord[0], coord[1], coord[2], nef);
-    rotate(angle[0], angle[1], angle[2], nef);
+    return union_reduce(levels);
+}
+
+//This function generates the rows of the facade, in the facade's own coordinates (facade_grammar then
+//places it onto its side). With --facade-2d, the rows are recorded as a Flat_solid (with the instances
+//copied into it) and extruded, so the facade is a single solid placed with one transformation.
+template<class Solid>
+Assembly<Solid> gen_facade(const Facade_spec& spec, double door_parameters[],double window_scale_parameters[], double window_design_parameters[], double coord[], double angle[], double grid_bottom_parameters[], double grid_center_parameters[], double grid_top_parameters[], double width, double height, int shape_type, int side, double vertical_offset){
+    Stage_timer timer("gen_facade");
+    
+    Assembly<Solid> nef;
+    if(facade_2d){
+        Assembly<Flat_solid> flat = gen_rows<Flat_solid>(spec, door_parameters, window_scale_parameters, window_design_parameters, coord, angle, grid_bottom_parameters, grid_center_parameters, grid_top_parameters, width, height, shape_type, side, vertical_offset);
+        for(std::size_t i = 0; i<flat.instances.size(); i++){
+            Flat_solid instance = *flat.instances[i].prototype;
+            instance.transform(flat.instances[i].transformation);
+            flat.nef+=instance;
+        }
+        nef.nef = extrude_flat<Solid>(flat.nef);
+    }
+    else
+        nef = gen_rows<Solid>(spec, door_parameters, window_scale_parameters, window_design_parameters, coord, angle, grid_bottom_parameters, grid_center_parameters, grid_top_parameters, width, height, shape_type, side, vertical_offset);
     
     return nef;
     
 }
 
-//This function is essentially a gateway into the actual facade generation.
-//Here, it just checks the shape type and sends the coordinates based on the
-//shape to the gen_facade function.
+//A Facade_side holds the placement and parameters of one side, as given to gen_facade.
+struct Facade_side{
+    double coord[3];
+    double angle[3];
+    double width;
+    int door;
+    int side;
+};
+
+Facade_side facade_side(double x, double y, double z, double angle_z, double width, int door, int side){
+    Facade_side facade = {{x, y, z}, {0, 0, angle_z}, width, door, side};
+    return facade;
+}
 
-Nef_polyhedron facade_grammar(std::vector<std::vector <int> > remove_windows, int sides, int shape_type, double building_parameters[],std::vector <std::vector <int> > railing_parameters, double grid_bottom_parameters[], double grid_center_parameters[], double grid_top_parameters[], double window_scale_parameters[], double  window_design_parameters[], double door_parameters[], double vertical_offset){
+//This compiles the spec of a side from the door, removed windows and railings in the parameter lists.
+Facade_spec facade_spec(const Facade_side& facade, const std::vector<std::vector <int> >& remove_windows, const std::vector <std::vector <int> >& railing_parameters, double door_parameters[], double grid_bottom_parameters[], double grid_center_parameters[], double grid_top_parameters[], int lod){
+    int side = facade.side+1;
+    
+    Facade_spec spec;
+    spec.lod = lod;
+    spec.counts = NULL;
+    spec.grid_widths[0] = grid_bottom_parameters[facade.side];
+    spec.grid_widths[1] = grid_center_parameters[facade.side];
+    spec.grid_widths[2] = grid_top_parameters[facade.side];
+    spec.grid_height = std::max(static_cast<int>(grid_top_parameters[6]), 1);
+    spec.row_width = std::max(0, *std::max_element(spec.grid_widths.begin(), spec.grid_widths.end()));
+    
+    spec.door.assign(spec.grid_height*spec.row_width, false);
+    spec.removed.assign(spec.grid_height*spec.row_width, false);
+    for(int y = 0; y<spec.grid_height; y++)
+        for(int x = 0; x<spec.row_width; x++){
+            spec.door[y*spec.row_width+x] = facade.door==0 && y==0 && x==door_parameters[0];
+            for(std::size_t i = 0; i<remove_windows.size(); i++)
+                if( (side==remove_windows[i][2] || remove_windows[i][2]<0) && (x==remove_windows[i][0] || remove_windows[i][0]<0) &&(y==remove_windows[i][1] || remove_windows[i][1]<0) ){
+                    spec.removed[y*spec.row_width+x] = true;
+                    break;
+                }
+        }
     
+    //Only the first railing which matches a row is used. The railings are left out below level of detail 2.
+    spec.railing.assign(spec.grid_height, false);
+    spec.railing_size.assign(spec.grid_height, 0);
+    for(int y = 0; y<spec.grid_height && lod>=2; y++)
+        for(std::size_t i = 0; i<railing_parameters.size(); i++)
+            if((side == railing_parameters[i][2] || railing_parameters[i][2] <0) && (y==railing_parameters[i][1] || railing_parameters[i][1] <0)){
+                spec.railing[y] = true;
+                spec.railing_size[y] = railing_parameters[i][0];
+                break;
+            }
+    return spec;
+}
+
+//This returns the placement of each side of the building, for its shape type.
+std::vector<Facade_side> facade_sides(int sides, int shape_type, double building_parameters[]){
     double building_width = building_parameters[0];
     double building_length = building_parameters[1];
     double building_height = building_parameters[4];
     
-    Nef_polyhedron nef;
+    std::vector<Facade_side> facades;
     
     //The rectangle facade is split into two parts, one for each side
     //(As the widths for the two side types are different)
     if(shape_type==1){
         
-        for(int i = 0; i<=1; i++){
-            double coord[3] = {-building_width/2,-building_length/2,-building_height/2};
-            double angle[3] {0,0,static_cast<double>(180*i)};
-            
-            
-            nef+=gen_facade(remove_windows, door_parameters, window_scale_parameters, window_design_parameters, railing_parameters, coord, angle, grid_bottom_parameters, grid_center_parameters, grid_top_parameters,building_length, building_height, shape_type, i, 0, vertical_offset);
-        }
-        for(int i = 0; i<=1; i++){
-            double coord[3] = {-building_length/2,-building_width/2,-building_height/2};
-            double angle[3] {0,0,90+static_cast<double>(180*i)};
-            
-            nef+=gen_facade(remove_windows, door_parameters, window_scale_parameters, window_design_parameters, railing_parameters, coord, angle, grid_bottom_parameters, grid_center_parameters, grid_top_parameters, building_width, building_height, shape_type, 1, 1, vertical_offset);
-        }
+        for(int i = 0; i<=1; i++)
+            facades.push_back(facade_side(-building_width/2,-building_length/2,-building_height/2, static_cast<double>(180*i), building_length, i, 0));
+        
+        for(int i = 0; i<=1; i++)
+            facades.push_back(facade_side(-building_length/2,-building_width/2,-building_height/2, 90+static_cast<double>(180*i), building_width, 1, 1));
     }
     //Due to the polygon having the same side length, it is just repeated in a loop for n times
     if(shape_type==2){
@@ -738,17 +2495,10 @@ Nef_polyhedron facade_grammar(std::vector<std::vector <int> > remove_windows, in
         double inradius = building_width/(2*tan_x);//Midpoint of side
         double facade_angle = 180-(side_angle/2+90);
         
-        
-        double coord[3] = {inradius,-building_width/2,-building_height/2};
-        
         //Note: It is sides*2, and being incremented by 2 instead of one due to the
         //facade placement onto the shape.
-        for(int i =1; i<=sides*2; i+=2){
-            
-            double angle[3] {0,0,(facade_angle)*i};
-            
-            nef+=gen_facade(remove_windows, door_parameters, window_scale_parameters, window_design_parameters, railing_parameters, coord, angle, grid_bottom_parameters, grid_center_parameters, grid_top_parameters,building_width, building_height, shape_type, (i-1), i/2, vertical_offset);
-        }
+        for(int i =1; i<=sides*2; i+=2)
+            facades.push_back(facade_side(inradius,-building_width/2,-building_height/2, (facade_angle)*i, building_width, (i-1), i/2));
         
     }
     //Due to the L shape having six different side lengths, gen_facade is called six times.
@@ -756,32 +2506,243 @@ Nef_polyhedron facade_grammar(std::vector<std::vector <int> > remove_windows, in
         double building_width_2 = building_parameters[2];
         double building_length_2 = building_parameters[3];
         
-        double coord1[3] = {-building_length_2/2,-building_width/2,-building_height/2};
-        double coord2[3] = {-(building_width/2+building_width_2),-building_length_2/2,-building_height/2};
-        double coord3[3] = {-building_width/2,-(building_length_2/2+building_length),-building_height/2};
-        double coord4[3] = {-(building_length_2/2+building_length),-building_width/2,-building_height/2};
-        double coord5[3] = {-building_length_2/2,-(building_width/2+building_width_2),-building_height/2};
-        double coord6[3] = {-building_width/2,building_length_2/2,-building_height/2};
-        
-        double angle1[3] = {0,0,0};
-        double angle2[3] = {0,0,270};
-        double angle3[3] = {0,0,90};
-        double angle4[3] = {0,0,180};
-        double angle5[3] = {0,0,180};
-        double angle6[3] = {0,0,270};
-        
-        nef+=gen_facade(remove_windows, door_parameters, window_scale_parameters, window_design_parameters, railing_parameters, coord1, angle1, grid_bottom_parameters, grid_center_parameters, grid_top_parameters,(building_width+building_width_2), building_height, shape_type, 0, 0, vertical_offset);
-        nef+=gen_facade(remove_windows, door_parameters, window_scale_parameters, window_design_parameters, railing_parameters, coord2, angle2, grid_bottom_parameters, grid_center_parameters, grid_top_parameters,building_length_2, building_height, shape_type, 1, 1, vertical_offset);
-        nef+=gen_facade(remove_windows, door_parameters, window_scale_parameters, window_design_parameters, railing_parameters, coord3, angle3, grid_bottom_parameters, grid_center_parameters, grid_top_parameters,(building_length+building_length_2), building_height, shape_type, 1, 2, vertical_offset);
-        nef+=gen_facade(remove_windows, door_parameters, window_scale_parameters, window_design_parameters, railing_parameters, coord4, angle4, grid_bottom_parameters, grid_center_parameters, grid_top_parameters,building_width, building_height, shape_type, 1, 3, vertical_offset);
-        nef+=gen_facade(remove_windows, door_parameters, window_scale_parameters, window_design_parameters, railing_parameters, coord5, angle5, grid_bottom_parameters, grid_center_parameters, grid_top_parameters,building_width_2, building_height, shape_type, 1, 4, vertical_offset);
-        nef+=gen_facade(remove_windows, door_parameters, window_scale_parameters, window_design_parameters, railing_parameters, coord6, angle6, grid_bottom_parameters, grid_center_parameters, grid_top_parameters,building_length, building_height, shape_type, 1, 5, vertical_offset);
+        facades.push_back(facade_side(-building_length_2/2,-building_width/2,-building_height/2, 0, (building_width+building_width_2), 0, 0));
+        facades.push_back(facade_side(-(building_width/2+building_width_2),-building_length_2/2,-building_height/2, 270, building_length_2, 1, 1));
+        facades.push_back(facade_side(-building_width/2,-(building_length_2/2+building_length),-building_height/2, 90, (building_length+building_length_2), 1, 2));
+        facades.push_back(facade_side(-(building_length_2/2+building_length),-building_width/2,-building_height/2, 180, building_width, 1, 3));
+        facades.push_back(facade_side(-building_length_2/2,-(building_width/2+building_width_2),-building_height/2, 180, building_width_2, 1, 4));
+        facades.push_back(facade_side(-building_width/2,building_length_2/2,-building_height/2, 270, building_length, 1, 5));
     }
+    return facades;
+}
+
+//This function is essentially a gateway into the actual facade generation.
+//Here, it just checks the shape type and sends the coordinates based on the
+//shape to the gen_facade function. Each side is generated as its own task.
+//If a stream is given (see --stream), each side is handed to it as soon as it is placed, and then freed
+//instead of being merged, so the returned assembly is empty.
+
+template<class Solid>
+Assembly<Solid> facade_grammar(const std::vector<std::vector <int> >& remove_windows, int sides, int shape_type, double building_parameters[],const std::vector <std::vector <int> >& railing_parameters, double grid_bottom_parameters[], double grid_center_parameters[], double grid_top_parameters[], double window_scale_parameters[], double  window_design_parameters[], double door_parameters[], double vertical_offset, int lod, Tile_counts* counts, const std::function<void(std::size_t, const Assembly<Solid>&)>& stream = nullptr){
+    Stage_timer timer("facade_grammar");
     
-    return nef;
+    double building_height = building_parameters[4];
+    std::vector<Facade_side> facades = facade_sides(sides, shape_type, building_parameters);
+    
+    //Every side of the polygon has the same width and height, so sides with the same spec have the same
+    //facade, only rotated. Each distinct facade is generated once, and copied onto its sides.
+    std::vector<Facade_spec> specs;
+    std::vector<Tile_counts> side_counts(facades.size());
+    std::vector<std::size_t> source(facades.size());
+    std::map<Facade_spec, std::size_t> distinct;
+    for(std::size_t i = 0; i<facades.size(); i++){
+        specs.push_back(facade_spec(facades[i], remove_windows, railing_parameters, door_parameters, grid_bottom_parameters, grid_center_parameters, grid_top_parameters, lod));
+        specs[i].counts = &side_counts[i];
+        source[i] = i;
+        if(shape_type==2)
+            source[i] = distinct.insert(std::make_pair(specs[i], i)).first->second;
+    }
+    
+    std::vector<Assembly<Solid> > sides_nef(facades.size());
+    auto place = [&](std::size_t i){
+        Facade_side& facade = facades[i];
+        translate(facade.coord[0], facade.coord[1], facade.coord[2], sides_nef[i]);
+        rotate(facade.angle[0], facade.angle[1], facade.angle[2], sides_nef[i]);
+        if(stream){
+            stream(i, sides_nef[i]);
+            sides_nef[i] = Assembly<Solid>();
+        }
+    };
+    
+    //When streaming, a facade which isn't copied onto another side is placed (and freed) by its own task.
+    std::vector<bool> placed(facades.size(), false);
+    for(std::size_t i = 0; i<facades.size(); i++)
+        placed[i] = stream && std::count(source.begin(), source.end(), i)==1;
+    
+    Task_group group(task_pool);
+    for(std::size_t i = 0; i<facades.size(); i++)
+        if(source[i]==i)
+            group.run([&, i](){
+                Facade_side& facade = facades[i];
+                sides_nef[i] = gen_facade<Solid>(specs[i], door_parameters, window_scale_parameters, window_design_parameters, facade.coord, facade.angle, grid_bottom_parameters, grid_center_parameters, grid_top_parameters, facade.width, building_height, shape_type, facade.side, vertical_offset);
+                if(placed[i]) place(i);
+            });
+        else
+            profile_count("reused facades", 1);
+    group.wait();
+    
+    //The copies are taken before any facade is placed, as each facade is placed onto its own side.
+    for(std::size_t i = 0; i<facades.size(); i++){
+        if(source[i]!=i) sides_nef[i] = sides_nef[source[i]];
+        if(counts) counts->add(side_counts[source[i]]);
+    }
+    
+    for(std::size_t i = 0; i<facades.size(); i++)
+        if(!placed[i])
+            group.run([&, i](){ place(i); });
+    group.wait();
+    
+    return union_reduce(sides_nef);
+    
+}
+
+
+//------------------------------COST MODEL--------------------------
+
+//The cost model estimates the Booleans, output triangles and time of a building from its resolved
+//parameters alone, before any geometry is generated. A 2x2 rectangle takes seconds where a 6 sided
+//polygon with large grids and window design 3 takes minutes, so batch mode starts the buildings with
+//the largest estimates first, and --triangle-budget skips the buildings estimated over the budget.
+//Each estimate is a linear function of the features below, which are counted from the Facade_spec
+//of each side just as gen_level places the tiles (at full detail).
+enum Cost_feature{COST_BUILDING, COST_DESIGN_1, COST_DESIGN_2, COST_DESIGN_3, COST_DESIGN_4, COST_DESIGN_5, COST_ROWS, COST_RAILINGS, COST_DOORS, COST_SIDES, COST_FEATURES};
+const char* cost_feature_names[COST_FEATURES] = {"building", "design 1", "design 2", "design 3", "design 4", "design 5", "rows", "railings", "doors", "sides"};
+
+typedef std::array<double, COST_FEATURES> Cost_vector;
+
+struct Cost_estimate{
+    Cost_vector features;
+    double booleans;
+    double triangles;
+    double seconds;
+};
+
+//The coefficients of each estimate, by feature. The defaults are rough values for the exact backend on
+//one thread, and can be replaced with the ones fitted by the benchmark (--calibrate, --cost-model).
+struct Cost_model{
+    Cost_vector booleans;
+    Cost_vector triangles;
+    Cost_vector seconds;
+};
+
+Cost_model cost_model = {
+    {{12, 1, 1, 1, 1, 1, 1, 3, 2, 3}},
+    {{60, 36, 60, 180, 84, 108, 0, 240, 120, 12}},
+    {{0.5, 0.02, 0.04, 0.3, 0.05, 0.08, 0.05, 0.3, 0.2, 0.2}}
+};
+
+double dot(const Cost_vector& a, const Cost_vector& b){
+    double sum = 0;
+    for(int i = 0; i<COST_FEATURES; i++) sum+=a[i]*b[i];
+    return sum;
+}
+
+//This counts the features of a building and estimates its cost.
+Cost_estimate estimate_cost(const std::vector<std::vector <int> >& remove_windows, int sides, int shape_type, double building_parameters[], const std::vector <std::vector <int> >& railing_parameters, double grid_bottom_parameters[], double grid_center_parameters[], double grid_top_parameters[], double window_scale_parameters[], double window_design_parameters[], double door_parameters[]){
+    Cost_estimate estimate;
+    estimate.features.fill(0);
+    estimate.features[COST_BUILDING] = 1;
+    
+    std::vector<Facade_side> facades = facade_sides(sides, shape_type, building_parameters);
+    for(std::size_t i = 0; i<facades.size(); i++){
+        Facade_spec spec = facade_spec(facades[i], remove_windows, railing_parameters, door_parameters, grid_bottom_parameters, grid_center_parameters, grid_top_parameters, 3);
+        estimate.features[COST_SIDES]++;
+        
+        //The bottom and top rows are both generated if the grid height is 1 (see gen_rows).
+        for(int row = 0; row<std::max(spec.grid_height, 2); row++){
+            int y = row==std::max(spec.grid_height, 2)-1 ? spec.grid_height-1 : row;
+            int grid_width = spec.grid_widths[row==0 ? 0 : y==spec.grid_height-1 ? 2 : 1];
+            int design = window_design(window_scale_parameters, window_design_parameters, y, spec.grid_height);
+            //The bottom row only has windows if it has a height.
+            bool windows = (y>0 || grid_bottom_parameters[6]>0) && design>=1 && design<=5;
+            
+            estimate.features[COST_ROWS]++;
+            if(spec.has_railing(y)) estimate.features[COST_RAILINGS]++;
+            for(int x = 0; x<grid_width; x++){
+                if(spec.has_door(x, y)) estimate.features[COST_DOORS]++;
+                else if(windows && !spec.is_removed(x, y)) estimate.features[COST_DESIGN_1+design-1]++;
+            }
+        }
+    }
     
+    estimate.booleans = std::max(0.0, dot(cost_model.booleans, estimate.features));
+    estimate.triangles = std::max(0.0, dot(cost_model.triangles, estimate.features));
+    estimate.seconds = std::max(0.0, dot(cost_model.seconds, estimate.features));
+    return estimate;
+}
+
+//The cost model file has a line for each estimate, with its coefficients in the order of the features.
+void write_cost_model(std::string file_name, std::size_t runs){
+    std::ofstream out(file_name);
+    out << "//Fitted from " << runs << " benchmark runs. Features:";
+    for(int i = 0; i<COST_FEATURES; i++) out << (i ? ", " : " ") << cost_feature_names[i];
+    out << "\n";
+    
+    const char* names[3] = {"Booleans", "Triangles", "Seconds"};
+    const Cost_vector* vectors[3] = {&cost_model.booleans, &cost_model.triangles, &cost_model.seconds};
+    out.precision(9);
+    for(int i = 0; i<3; i++){
+        out << names[i] << " =";
+        for(int j = 0; j<COST_FEATURES; j++) out << (j ? ", " : " ") << (*vectors[i])[j];
+        out << "\n";
+    }
+}
+
+void read_cost_model(std::string file_name){
+    std::ifstream in(file_name);
+    if(!in.is_open()){
+        std::cout << "Unable to open cost model " << file_name << ", using the defaults" << std::endl;
+        return;
+    }
+    std::string line;
+    while(getline(in, line)){
+        if(!line.substr(0, 2).compare("//") || line.find(" = ")==std::string::npos) continue;
+        std::string data = line.substr(0, line.find(" = "));
+        Cost_vector* vector = NULL;
+        if(!data.compare("Booleans")) vector = &cost_model.booleans;
+        else if(!data.compare("Triangles")) vector = &cost_model.triangles;
+        else if(!data.compare("Seconds")) vector = &cost_model.seconds;
+        if(!vector) continue;
+        
+        std::string numbers = line.substr(line.find(" = ")+3);
+        for(int i = 0; i<COST_FEATURES; i++){
+            (*vector)[i] = atof(numbers.c_str());
+            if(numbers.find(",")==std::string::npos) break;
+            numbers = numbers.substr(numbers.find(",")+1);
+        }
+    }
 }
 
+//This fits the coefficients of one estimate to the measured values by least squares (with a little ridge
+//regularization, as some features always come together, like the door and the building). A feature which
+//is zero in every run can't be fitted, and keeps its coefficient.
+void fit_cost(const std::vector<Cost_vector>& features, const std::vector<double>& values, Cost_vector& coefficients){
+    std::vector<int> used;
+    for(int j = 0; j<COST_FEATURES; j++)
+        for(std::size_t i = 0; i<features.size(); i++)
+            if(features[i][j]!=0){
+                used.push_back(j);
+                break;
+            }
+    std::size_t n = used.size();
+    if(n==0) return;
+    
+    //The normal equations (A^T A + ridge I) x = A^T b, solved by Gaussian elimination.
+    std::vector<std::vector<double> > system(n, std::vector<double>(n+1, 0));
+    for(std::size_t i = 0; i<features.size(); i++)
+        for(std::size_t r = 0; r<n; r++){
+            for(std::size_t c = 0; c<n; c++) system[r][c]+=features[i][used[r]]*features[i][used[c]];
+            system[r][n]+=features[i][used[r]]*values[i];
+        }
+    double ridge = 0;
+    for(std::size_t r = 0; r<n; r++) ridge = std::max(ridge, system[r][r]*1e-6);
+    for(std::size_t r = 0; r<n; r++) system[r][r]+=ridge;
+    
+    for(std::size_t c = 0; c<n; c++){
+        std::size_t pivot = c;
+        for(std::size_t r = c+1; r<n; r++)
+            if(std::fabs(system[r][c])>std::fabs(system[pivot][c])) pivot = r;
+        std::swap(system[c], system[pivot]);
+        if(system[c][c]==0) return;
+        for(std::size_t r = 0; r<n; r++){
+            if(r==c) continue;
+            double factor = system[r][c]/system[c][c];
+            for(std::size_t k = c; k<=n; k++) system[r][k]-=factor*system[c][k];
+        }
+    }
+    for(std::size_t r = 0; r<n; r++)
+        coefficients[used[r]] = system[r][n]/system[r][r];
+}
 
 //------------------------------BUIDLING GRAMMAR--------------------------
 
@@ -791,7 +2752,9 @@ Nef_polyhedron facade_grammar(std::vector<std::vector <int> > remove_windows, in
 
 //The shape_grammar function takes the entiriety of the parameters then checks what shape type was selected.
 //From there, it calls the specific module for generating each shape.
-Nef_polyhedron gen_rectangle(double building_parameters[5], double overhang_parameters[3]){
+template<class Solid>
+Solid gen_rectangle(double building_parameters[5], double overhang_parameters[3]){
+    Stage_timer timer("gen_rectangle");
     
     double building_width = building_parameters[0];
     double building_length = building_parameters[1];
@@ -801,30 +2764,35 @@ Nef_polyhedron gen_rectangle(double building_parameters[5], double overhang_para
     double overhang_thickness = overhang_parameters[1];
     double overhang_height = overhang_parameters[2];
     
-    Nef_polyhedron nef_building =  cube(building_width);
+    Solid nef_building =  cube<Solid>(building_width);
     scale(1, building_length/building_width,building_height/building_width, nef_building);
     
-    Nef_polyhedron nef_overhang =  square( (building_width+overhang_width*2), (building_length+overhang_width*2));
-    scale(1,1,overhang_height, nef_overhang);
-    translate(0,0,building_height/2, nef_overhang);
-    
-    Nef_polyhedron nef_subtract = square( (building_width+overhang_width*2-overhang_thickness*2), (building_length+overhang_width*2-overhang_thickness*2));
-    scale(1,1,overhang_height, nef_subtract);
-    
-    translate(0,0,building_height/2, nef_subtract);
+    //The overhang is a rectangular frame around the roof, overhang_thickness thick.
+    Outline overhang_outer = rectangle_outline(building_width+overhang_width*2, building_length+overhang_width*2);
+    Outline overhang_inner = rectangle_outline(building_width+overhang_width*2-overhang_thickness*2, building_length+overhang_width*2-overhang_thickness*2);
+    double overhang_bottom = building_height/2-overhang_height/2;
+    double overhang_top = building_height/2+overhang_height/2;
     
+    Solid nef_overhang;
+    if(overhang_thickness>0){
+        if(overhang_inner[2][0]>0 && overhang_inner[2][1]>0) nef_overhang = mesh_solid<Solid>(frame_prism_mesh(overhang_outer, overhang_inner, overhang_bottom, overhang_top, 0));
+        else nef_overhang = mesh_solid<Solid>(prism_mesh(overhang_outer, overhang_bottom, overhang_top));
+    }
     
-    Nef_polyhedron nef_roof =  square( (building_width+overhang_width*1.99), (building_length+overhang_width*1.99));
+    Solid nef_roof =  square<Solid>( (building_width+overhang_width*1.99), (building_length+overhang_width*1.99));
     translate(0,0,building_height/2, nef_roof);
     
-    return nef_building+nef_roof+ (nef_overhang-nef_subtract);
+    std::vector<Solid> parts = {nef_building, nef_roof, nef_overhang};
+    return union_reduce(parts);
     
 }
 
 //This function generates a n sided polygon. It does so by calculating the circumradius and using that value to
 //generate a n amount of cylinders to be used with the hull function to fill the volume, generating a polygon.
 //The overhang works similarly.
-Nef_polyhedron gen_polygon(double building_parameters[5], double overhang_parameters[3], int sides){
+template<class Solid>
+Solid gen_polygon(double building_parameters[5], double overhang_parameters[3], int sides){
+    Stage_timer timer("gen_polygon");
     double building_width = building_parameters[0];
     double building_height = building_parameters[4];
     
@@ -832,22 +2800,33 @@ Nef_polyhedron gen_polygon(double building_parameters[5], double overhang_parame
     double overhang_thickness = overhang_parameters[1];
     double overhang_height = overhang_parameters[2];
     
-    Nef_polyhedron nef_building = polygon(0, building_width, building_height, sides);
-    Nef_polyhedron nef_roof = polygon(overhang_width*0.9, building_width, overhang_height*0.1, sides);
-    Nef_polyhedron nef_overhang = polygon(overhang_width, building_width, overhang_height/2, sides);
-    Nef_polyhedron nef_overhang_subtract = polygon(overhang_width-overhang_thickness, building_width, overhang_height/2, sides);
-    
+    Solid nef_building = polygon<Solid>(0, building_width, building_height, sides);
+    Solid nef_roof = polygon<Solid>(overhang_width*0.9, building_width, overhang_height*0.1, sides);
     translate(0,0,building_height/2, nef_roof);
-    translate(0,0,building_height/2+overhang_height/2, nef_overhang);
-    translate(0,0,building_height/2+overhang_height/2*1.01, nef_overhang_subtract);
     
-    return nef_building+nef_roof+(nef_overhang-nef_overhang_subtract);
+    //The overhang is a ring around the roof, overhang_thickness thick. The hole stops just above the
+    //bottom of the ring (by 0.5% of the overhang height), leaving a thin floor.
+    Outline overhang_outer = polygon_outline(overhang_width, building_width, sides);
+    Outline overhang_inner = polygon_outline(overhang_width-overhang_thickness, building_width, sides);
+    double overhang_bottom = building_height/2+overhang_height/2-overhang_height/4;
+    double overhang_top = building_height/2+overhang_height/2+overhang_height/4;
+    double overhang_floor = overhang_height/2*0.01;
+    
+    Solid nef_overhang;
+    if(overhang_thickness<=0) nef_overhang = mesh_solid<Solid>(prism_mesh(overhang_outer, overhang_bottom, overhang_bottom+overhang_floor));
+    else if(overhang_inner[0][0]>0) nef_overhang = mesh_solid<Solid>(frame_prism_mesh(overhang_outer, overhang_inner, overhang_bottom, overhang_top, overhang_floor));
+    else nef_overhang = mesh_solid<Solid>(prism_mesh(overhang_outer, overhang_bottom, overhang_top));
+    
+    std::vector<Solid> parts = {nef_building, nef_roof, nef_overhang};
+    return union_reduce(parts);
 }
 
 //This function generates an L shaped building. It does so by first generating two cubes of width, height 1, 2.
 //Then it translates them so that the two widths become one large one. The overhang is created using three
 //convex hulls, where each hull is comprised of eight vertices.
-Nef_polyhedron gen_L(double building_parameters[5], double overhang_parameters[3]){
+template<class Solid>
+Solid gen_L(double building_parameters[5], double overhang_parameters[3]){
+    Stage_timer timer("gen_L");
     
     double building_width_1 = building_parameters[0];
     double building_length_1 = building_parameters[1];
@@ -862,22 +2841,23 @@ Nef_polyhedron gen_L(double building_parameters[5], double overhang_parameters[3
     //This segment handles the actual L shape generation. Here, it splits the process into two parts,
     //one for each "cube" it generates
     
-    Nef_polyhedron nef_cube1 =cube(building_width_1);
+    Solid nef_cube1 =cube<Solid>(building_width_1);
     scale((building_length_1+building_length_2)/building_width_1, 1,building_height/building_width_1, nef_cube1);
     
-    Nef_polyhedron nef_roof1 =  square(building_length_2+overhang_width*1.8, building_width_2+overhang_width*1.8);
+    Solid nef_roof1 =  square<Solid>(building_length_2+overhang_width*1.8, building_width_2+overhang_width*1.8);
     translate(0,0,building_height/2, nef_roof1);
     
-    Nef_polyhedron nef_cube2 =  cube(building_width_2);
+    Solid nef_cube2 =  cube<Solid>(building_width_2);
     scale(building_length_2/building_width_2,1,building_height/building_width_2, nef_cube2);
     nef_cube2+=nef_roof1;
     translate(-building_length_1/2,(building_width_1+building_width_2)/2,0, nef_cube2);
     
     
-    Nef_polyhedron nef_roof2 = square( (building_length_1+building_length_2+overhang_width*1.8), building_width_1+overhang_width*1.8);
+    Solid nef_roof2 = square<Solid>( (building_length_1+building_length_2+overhang_width*1.8), building_width_1+overhang_width*1.8);
     translate(0,0,building_height/2, nef_roof2);
     
-    Nef_polyhedron building_L = nef_cube1+nef_cube2+nef_roof2;
+    std::vector<Solid> building_parts = {nef_cube1, nef_cube2, nef_roof2};
+    Solid building_L = union_reduce(building_parts);
     translate(building_length_1/2,0,0, building_L);
     
     //The convex hull generation for the overhang.
@@ -942,37 +2922,21 @@ Nef_polyhedron gen_L(double building_parameters[5], double overhang_parameters[3
         {building_length_2/2+overhang_width-overhang_thickness,building_width_1/2+overhang_width,building_height/2-overhang_height},
         {-building_length_2/2-overhang_width+overhang_thickness,building_width_1/4+overhang_width,building_height/2-overhang_height}
     };
-    //Converting the convex poyhedron hulls into nefs.
-    Polyhedron_3 polygon_overhang_1;
-    hull(polygon_overhang_1, coord_overhang_1, 8);
-    Nef_polyhedron nef_overhang_1(polygon_overhang_1);
-    
-    Polyhedron_3 polygon_overhang_subtract_1;
-    hull(polygon_overhang_subtract_1, coord_overhang_subtract_1, 8);
-    Nef_polyhedron nef_overhang_subtract_1(polygon_overhang_subtract_1);
-    
-    Polyhedron_3 polygon_overhang_2;
-    hull(polygon_overhang_2, coord_overhang_2, 8);
-    Nef_polyhedron nef_overhang_2(polygon_overhang_2);
-    
-    Polyhedron_3 polygon_overhang_subtract_2;
-    hull(polygon_overhang_subtract_2, coord_overhang_subtract_2, 8);
-    Nef_polyhedron nef_overhang_subtract_2(polygon_overhang_subtract_2);
-    
-    Polyhedron_3 polygon_overhang_3;
-    hull(polygon_overhang_3, coord_overhang_3, 8);
-    Nef_polyhedron nef_overhang_3(polygon_overhang_3);
-    
-    Polyhedron_3 polygon_overhang_subtract_3;
-    hull(polygon_overhang_subtract_3, coord_overhang_subtract_3, 8);
-    Nef_polyhedron nef_overhang_subtract_3(polygon_overhang_subtract_3);
+    //Converting the convex poyhedron hulls into solids.
+    Solid nef_overhang_1 = hull_solid<Solid>(coord_overhang_1, 8);
+    Solid nef_overhang_subtract_1 = hull_solid<Solid>(coord_overhang_subtract_1, 8);
+    Solid nef_overhang_2 = hull_solid<Solid>(coord_overhang_2, 8);
+    Solid nef_overhang_subtract_2 = hull_solid<Solid>(coord_overhang_subtract_2, 8);
+    Solid nef_overhang_3 = hull_solid<Solid>(coord_overhang_3, 8);
+    Solid nef_overhang_subtract_3 = hull_solid<Solid>(coord_overhang_subtract_3, 8);
     
     //Each of the three parts comprises two hulls being differenced.
-    Nef_polyhedron overhang_1 =nef_overhang_1-nef_overhang_subtract_1;
-    Nef_polyhedron overhang_2 =nef_overhang_2-nef_overhang_subtract_2;
-    Nef_polyhedron overhang_3 =nef_overhang_3-nef_overhang_subtract_3;
+    Solid overhang_1 =nef_overhang_1-nef_overhang_subtract_1;
+    Solid overhang_2 =nef_overhang_2-nef_overhang_subtract_2;
+    Solid overhang_3 =nef_overhang_3-nef_overhang_subtract_3;
     
-    return building_L+overhang_1+overhang_2+overhang_3;
+    std::vector<Solid> parts = {building_L, overhang_1, overhang_2, overhang_3};
+    return union_reduce(parts);
     
 }
 
@@ -985,12 +2949,13 @@ Nef_polyhedron gen_L(double building_parameters[5], double overhang_parameters[3
 //output text file. This file can later have its contents copied and used
 //to generate the same building with the "input_parameters.txt" file.
 
-void output_paramaters_txt(std::vector<std::vector <int> > remove_windows, int sides, int shape_type, double building_parameters[],std::vector <std::vector <int> > railing_parameters, double grid_bottom_parameters[], double grid_center_parameters[], double grid_top_parameters[], double window_scale_parameters[], double  window_design_parameters[], double door_parameters[],double vertical_offset, double overhang_parameters[], int num){
+void output_paramaters_txt(const std::vector<std::vector <int> >& remove_windows, int sides, int shape_type, double building_parameters[],const std::vector <std::vector <int> >& railing_parameters, double grid_bottom_parameters[], double grid_center_parameters[], double grid_top_parameters[], double window_scale_parameters[], double  window_design_parameters[], double door_parameters[],double vertical_offset, double overhang_parameters[], int num, unsigned long long seed){
     
     std::ofstream output_file ("output_parameters_"+std::to_string(num)+".txt");
     if (output_file.is_open())
     {
         
+        output_file << "Seed = "+std::to_string(seed)+"\n";
         output_file << "Shape Type = "+std::to_string(shape_type)+"\n";
         output_file << "Sides = "+std::to_string(sides)+"\n";
         
@@ -1043,90 +3008,1060 @@ void output_paramaters_txt(std::vector<std::vector <int> > remove_windows, int s
         output_file << "Door Width Scale = "+std::to_string(door_parameters[1])+"\n";
         output_file << "Door Height Scale = "+std::to_string(door_parameters[2])+"\n";
         
-        if(remove_windows.size() >0){
-            std::string remove_windows_line = "Remove Window = ";
-            
-            for(int i =0;i< remove_windows.size(); i++){
-                remove_windows_line+="(";
-                
-                
-                for(int j=0; j<3; j++){
-                    remove_windows_line+=std::to_string(remove_windows[i][j]);
-                    if(j<2) remove_windows_line+=",";
+        if(remove_windows.size() >0){
+            std::string remove_windows_line = "Remove Window = ";
+            
+            for(int i =0;i< remove_windows.size(); i++){
+                remove_windows_line+="(";
+                
+                
+                for(int j=0; j<3; j++){
+                    remove_windows_line+=std::to_string(remove_windows[i][j]);
+                    if(j<2) remove_windows_line+=",";
+                }
+                remove_windows_line+=")";
+                if(i<remove_windows.size()-1) remove_windows_line+=",";
+            }
+            output_file << remove_windows_line+"\n";
+        }
+        
+        if(railing_parameters.size()>0){
+            std::string railing_line = "Railings = ";
+            for(int i =0;i< railing_parameters.size(); i++){
+                railing_line+="(";
+                
+                for(int j=0; j<3; j++){
+                    railing_line+=std::to_string(railing_parameters[i][j]);
+                    if(j<2) railing_line+=",";
+                }
+                railing_line+=")";
+                if(i<railing_parameters.size()-1) railing_line+=",";
+            }
+            output_file << railing_line+"\n";
+        }
+        
+        output_file.close();
+    }
+    else std::cout << "Unable to open file";
+    
+    
+}
+//------------------------------MESH OUTPUT--------------------------
+
+//The building is written straight from its solids into the output file, without building a single
+//Surface_mesh of the whole building first. Each solid is converted once into a polygon soup of
+//double points (the exact coordinates are only rounded when they are written anyway), and every
+//instance then writes the soup of its prototype with its transformation applied.
+struct Mesh_soup{
+    std::vector<double> points;
+    std::vector<std::vector<std::size_t> > faces;
+};
+
+//Nef faces can be concave, so they are triangulated by CGAL when the format needs triangles.
+void convert_to_soup(const Nef_polyhedron& nef, Mesh_soup& soup, bool triangulate){
+    Stage_timer timer("convert");
+    std::vector<Exact_kernel::Point_3> points;
+    CGAL::convert_nef_polyhedron_to_polygon_soup(nef, points, soup.faces, triangulate);
+    for(std::size_t i = 0; i<points.size(); i++){
+        soup.points.push_back(CGAL::to_double(points[i].x()));
+        soup.points.push_back(CGAL::to_double(points[i].y()));
+        soup.points.push_back(CGAL::to_double(points[i].z()));
+    }
+}
+
+//The parts of a Fast_solid are just concatenated, as they don't overlap. Their faces are convex
+//(or already triangles from corefinement), so the writers can fan triangulate them.
+void convert_to_soup(const Fast_solid& solid, Mesh_soup& soup, bool){
+    Stage_timer timer("convert");
+    for(std::size_t i = 0; i<solid.parts.size(); i++){
+        const Fast_mesh& mesh = solid.parts[i];
+        std::size_t offset = soup.points.size()/3;
+        std::map<Fast_mesh::Vertex_index, std::size_t> index;
+        for(Fast_mesh::Vertex_index v : mesh.vertices()){
+            const Fast_mesh::Point& p = mesh.point(v);
+            std::size_t next = offset+index.size();
+            index[v] = next;
+            soup.points.push_back(p.x());
+            soup.points.push_back(p.y());
+            soup.points.push_back(p.z());
+        }
+        for(Fast_mesh::Face_index f : mesh.faces()){
+            std::vector<std::size_t> face;
+            for(Fast_mesh::Vertex_index v : CGAL::vertices_around_face(mesh.halfedge(f), mesh))
+                face.push_back(index[v]);
+            soup.faces.push_back(face);
+        }
+    }
+}
+
+//The pending transformation of a lazy solid is applied here.
+void convert_to_soup(const Lazy_nef& solid, Mesh_soup& soup, bool triangulate){
+    convert_to_soup(solid.applied(), soup, triangulate);
+}
+
+//The tree of a CSG solid is evaluated here. Its parts don't overlap, so they are just concatenated.
+void convert_to_soup(const Csg_solid& solid, Mesh_soup& soup, bool triangulate){
+    std::vector<Csg_part> parts = evaluate_csg(solid);
+    for(std::size_t i = 0; i<parts.size(); i++){
+        Mesh_soup part;
+        convert_to_soup(parts[i].nef, part, triangulate);
+        
+        std::size_t offset = soup.points.size()/3;
+        soup.points.insert(soup.points.end(), part.points.begin(), part.points.end());
+        for(std::size_t j = 0; j<part.faces.size(); j++){
+            for(std::size_t k = 0; k<part.faces[j].size(); k++)
+                part.faces[j][k]+=offset;
+            soup.faces.push_back(part.faces[j]);
+        }
+    }
+}
+
+//With --optimize-mesh, each converted soup is cleaned up before it is written. The Booleans split the
+//facets of the Nef polyhedra (the roof under the overhang, or the walls behind the tile grids) into
+//many coplanar pieces, and the parts of a Fast_solid each have their own copy of the vertices they
+//share. The cleanup welds the vertices closer than weld_tolerance (through a hash grid of cells of
+//that size), merges each set of adjacent faces which lie on the same plane into one polygon, drops
+//the vertices which are left in the middle of a straight edge, and triangulates the polygons again
+//if the format needs triangles. Only manifold edges are merged, and a set of faces which doesn't
+//form a single loop (a hole, or faces touching at a corner) is left as it is.
+struct Weld_cell_hash{
+    std::size_t operator()(const std::array<long long, 3>& cell) const{
+        return std::hash<long long>()(cell[0]*73856093LL ^ cell[1]*19349663LL ^ cell[2]*83492791LL);
+    }
+};
+
+//This returns the amount of faces the soup is written with.
+std::size_t output_faces(const Mesh_soup& soup, bool triangles){
+    if(!triangles) return soup.faces.size();
+    std::size_t count = 0;
+    for(std::size_t i = 0; i<soup.faces.size(); i++)
+        count+=soup.faces[i].size()-2;
+    return count;
+}
+
+//This welds the vertices of the soup, and removes the faces which are left with less than 3 vertices.
+void weld_vertices(Mesh_soup& soup){
+    std::unordered_map<std::array<long long, 3>, std::vector<std::size_t>, Weld_cell_hash> grid;
+    std::vector<std::size_t> welded(soup.points.size()/3);
+    std::vector<double> points;
+    for(std::size_t i = 0; i<welded.size(); i++){
+        const double* p = &soup.points[3*i];
+        std::array<long long, 3> cell;
+        for(int k = 0; k<3; k++) cell[k] = static_cast<long long>(std::floor(p[k]/weld_tolerance));
+        
+        //A vertex within the tolerance is in the same cell or in one of its neighbours.
+        welded[i] = points.size()/3;
+        for(int n = 0; n<27 && welded[i]==points.size()/3; n++){
+            std::array<long long, 3> near = {{cell[0]+n%3-1, cell[1]+n/3%3-1, cell[2]+n/9-1}};
+            auto found = grid.find(near);
+            if(found==grid.end()) continue;
+            for(std::size_t j = 0; j<found->second.size(); j++){
+                const double* q = &points[3*found->second[j]];
+                if(std::fabs(p[0]-q[0])<=weld_tolerance && std::fabs(p[1]-q[1])<=weld_tolerance && std::fabs(p[2]-q[2])<=weld_tolerance){
+                    welded[i] = found->second[j];
+                    break;
+                }
+            }
+        }
+        if(welded[i]==points.size()/3){
+            grid[cell].push_back(welded[i]);
+            points.insert(points.end(), p, p+3);
+        }
+    }
+    
+    std::vector<std::vector<std::size_t> > faces;
+    for(std::size_t i = 0; i<soup.faces.size(); i++){
+        std::vector<std::size_t> face;
+        for(std::size_t j = 0; j<soup.faces[i].size(); j++){
+            std::size_t v = welded[soup.faces[i][j]];
+            if(face.empty() || face.back()!=v) face.push_back(v);
+        }
+        while(face.size()>1 && face.front()==face.back()) face.pop_back();
+        if(face.size()>=3) faces.push_back(face);
+    }
+    soup.points.swap(points);
+    soup.faces.swap(faces);
+}
+
+//The unit normal of a face (by Newell's method) and its distance from the origin. The normal is zero
+//if the face has no area.
+std::array<double, 4> face_plane(const Mesh_soup& soup, const std::vector<std::size_t>& face){
+    std::array<double, 4> plane = {{0, 0, 0, 0}};
+    double center[3] = {0, 0, 0};
+    for(std::size_t i = 0; i<face.size(); i++){
+        const double* a = &soup.points[3*face[i]];
+        const double* b = &soup.points[3*face[(i+1)%face.size()]];
+        plane[0]+=(a[1]-b[1])*(a[2]+b[2]);
+        plane[1]+=(a[2]-b[2])*(a[0]+b[0]);
+        plane[2]+=(a[0]-b[0])*(a[1]+b[1]);
+        for(int k = 0; k<3; k++) center[k]+=a[k]/face.size();
+    }
+    double length = std::sqrt(plane[0]*plane[0]+plane[1]*plane[1]+plane[2]*plane[2]);
+    if(length<=0) return plane;
+    for(int k = 0; k<3; k++) plane[k]/=length;
+    plane[3] = plane[0]*center[0]+plane[1]*center[1]+plane[2]*center[2];
+    return plane;
+}
+
+bool same_plane(const std::array<double, 4>& a, const std::array<double, 4>& b){
+    return a[0]*b[0]+a[1]*b[1]+a[2]*b[2]>1-1e-9 && std::fabs(a[3]-b[3])<=weld_tolerance;
+}
+
+//This triangulates a polygon by clipping ears, in the plane of its normal. It returns false if the
+//polygon has no ear left to clip (if it is degenerate), in which case the triangles are not complete.
+bool triangulate_polygon(const Mesh_soup& soup, const std::vector<std::size_t>& polygon, const std::array<double, 4>& plane, std::vector<std::vector<std::size_t> >& triangles){
+    //The polygon is projected onto the axis plane closest to its own, keeping its orientation.
+    int axis = 0;
+    for(int k = 1; k<3; k++)
+        if(std::fabs(plane[k])>std::fabs(plane[axis])) axis = k;
+    int u = (axis+1)%3, v = (axis+2)%3;
+    double sign = plane[axis]>0 ? 1 : -1;
+    
+    std::vector<std::size_t> left = polygon;
+    auto x = [&](std::size_t i){ return soup.points[3*left[i]+u]; };
+    auto y = [&](std::size_t i){ return soup.points[3*left[i]+v]; };
+    auto cross = [&](std::size_t a, std::size_t b, std::size_t c){
+        return sign*((x(b)-x(a))*(y(c)-y(a))-(y(b)-y(a))*(x(c)-x(a)));
+    };
+    
+    while(left.size()>3){
+        bool clipped = false;
+        for(std::size_t i = 0; i<left.size() && !clipped; i++){
+            std::size_t a = (i+left.size()-1)%left.size(), c = (i+1)%left.size();
+            if(cross(a, i, c)<=0) continue;
+            
+            //Another vertex in the triangle (or on its edges) would be cut off by the ear.
+            bool ear = true;
+            for(std::size_t j = 0; j<left.size() && ear; j++)
+                if(j!=a && j!=i && j!=c && left[j]!=left[a] && left[j]!=left[i] && left[j]!=left[c])
+                    ear = cross(a, i, j)<0 || cross(i, c, j)<0 || cross(c, a, j)<0;
+            if(!ear) continue;
+            
+            triangles.push_back({left[a], left[i], left[c]});
+            left.erase(left.begin()+i);
+            clipped = true;
+        }
+        if(!clipped) return false;
+    }
+    triangles.push_back(left);
+    return true;
+}
+
+void optimize_soup(Mesh_soup& soup, bool triangles){
+    Stage_timer timer("optimize");
+    weld_vertices(soup);
+    
+    std::vector<std::array<double, 4> > planes;
+    for(std::size_t i = 0; i<soup.faces.size(); i++)
+        planes.push_back(face_plane(soup, soup.faces[i]));
+    
+    //The faces using each directed edge.
+    std::map<std::pair<std::size_t, std::size_t>, std::vector<std::size_t> > edges;
+    for(std::size_t i = 0; i<soup.faces.size(); i++)
+        for(std::size_t j = 0; j<soup.faces[i].size(); j++)
+            edges[std::make_pair(soup.faces[i][j], soup.faces[i][(j+1)%soup.faces[i].size()])].push_back(i);
+    
+    //Faces on the same plane are grouped across each manifold edge they share.
+    std::vector<std::size_t> group(soup.faces.size());
+    for(std::size_t i = 0; i<group.size(); i++) group[i] = i;
+    std::function<std::size_t(std::size_t)> find = [&](std::size_t i){ return group[i]==i ? i : group[i] = find(group[i]); };
+    for(auto edge = edges.begin(); edge!=edges.end(); ++edge){
+        auto twin = edges.find(std::make_pair(edge->first.second, edge->first.first));
+        if(twin==edges.end() || edge->second.size()!=1 || twin->second.size()!=1) continue;
+        std::size_t a = edge->second[0], b = twin->second[0];
+        if(a!=b && (planes[a][0]!=0 || planes[a][1]!=0 || planes[a][2]!=0) && same_plane(planes[a], planes[b]))
+            group[find(a)] = find(b);
+    }
+    std::map<std::size_t, std::vector<std::size_t> > groups;
+    for(std::size_t i = 0; i<group.size(); i++)
+        groups[find(i)].push_back(i);
+    
+    //Each group with a single boundary loop becomes one polygon. The others keep their faces.
+    std::vector<std::vector<std::size_t> > polygons;
+    std::vector<std::vector<std::size_t> > sources; //The original faces of each polygon.
+    std::vector<std::size_t> polygon_plane;
+    for(auto it = groups.begin(); it!=groups.end(); ++it){
+        const std::vector<std::size_t>& members = it->second;
+        std::map<std::size_t, std::size_t> next;
+        bool loop = members.size()>1;
+        if(loop){
+            std::set<std::pair<std::size_t, std::size_t> > inside;
+            for(std::size_t i = 0; i<members.size(); i++){
+                const std::vector<std::size_t>& face = soup.faces[members[i]];
+                for(std::size_t j = 0; j<face.size(); j++)
+                    inside.insert(std::make_pair(face[j], face[(j+1)%face.size()]));
+            }
+            for(auto edge = inside.begin(); edge!=inside.end() && loop; ++edge)
+                if(inside.find(std::make_pair(edge->second, edge->first))==inside.end())
+                    loop = next.insert(std::make_pair(edge->first, edge->second)).second;
+        }
+        std::vector<std::size_t> polygon;
+        if(loop && !next.empty()){
+            std::size_t v = next.begin()->first;
+            do{
+                polygon.push_back(v);
+                auto step = next.find(v);
+                if(step==next.end()) break;
+                v = step->second;
+            } while(v!=next.begin()->first && polygon.size()<=next.size());
+            loop = polygon.size()==next.size();
+        }
+        if(loop && polygon.size()>=3){
+            polygons.push_back(polygon);
+            sources.push_back(members);
+            polygon_plane.push_back(members[0]);
+        }
+        else{
+            for(std::size_t i = 0; i<members.size(); i++){
+                polygons.push_back(soup.faces[members[i]]);
+                sources.push_back(std::vector<std::size_t>(1, members[i]));
+                polygon_plane.push_back(members[i]);
+            }
+        }
+    }
+    
+    //A vertex used by exactly two polygons, in the middle of the same straight edge of both, is dropped.
+    std::vector<std::vector<std::array<std::size_t, 3> > > uses(soup.points.size()/3); //{polygon, previous, next}
+    for(std::size_t i = 0; i<polygons.size(); i++)
+        for(std::size_t j = 0; j<polygons[i].size(); j++)
+            uses[polygons[i][j]].push_back({{i, polygons[i][(j+polygons[i].size()-1)%polygons[i].size()], polygons[i][(j+1)%polygons[i].size()]}});
+    std::vector<bool> dropped(uses.size(), false);
+    for(std::size_t v = 0; v<uses.size(); v++){
+        if(uses[v].size()!=2 || uses[v][0][1]!=uses[v][1][2] || uses[v][0][2]!=uses[v][1][1]) continue;
+        const double* a = &soup.points[3*uses[v][0][1]];
+        const double* b = &soup.points[3*v];
+        const double* c = &soup.points[3*uses[v][0][2]];
+        double d1[3] = {b[0]-a[0], b[1]-a[1], b[2]-a[2]};
+        double d2[3] = {c[0]-b[0], c[1]-b[1], c[2]-b[2]};
+        double n[3] = {d1[1]*d2[2]-d1[2]*d2[1], d1[2]*d2[0]-d1[0]*d2[2], d1[0]*d2[1]-d1[1]*d2[0]};
+        double l1 = std::sqrt(d1[0]*d1[0]+d1[1]*d1[1]+d1[2]*d1[2]);
+        double l2 = std::sqrt(d2[0]*d2[0]+d2[1]*d2[1]+d2[2]*d2[2]);
+        dropped[v] = d1[0]*d2[0]+d1[1]*d2[1]+d1[2]*d2[2]>0 && std::sqrt(n[0]*n[0]+n[1]*n[1]+n[2]*n[2])<=1e-9*l1*l2;
+    }
+    
+    std::vector<std::vector<std::size_t> > faces;
+    for(std::size_t i = 0; i<polygons.size(); i++){
+        std::vector<std::size_t> polygon;
+        for(std::size_t j = 0; j<polygons[i].size(); j++)
+            if(!dropped[polygons[i][j]]) polygon.push_back(polygons[i][j]);
+        if(polygon.size()<3) continue;
+        
+        if(!triangles || polygon.size()==3){
+            faces.push_back(polygon);
+            continue;
+        }
+        std::vector<std::vector<std::size_t> > clipped;
+        if(triangulate_polygon(soup, polygon, planes[polygon_plane[i]], clipped))
+            faces.insert(faces.end(), clipped.begin(), clipped.end());
+        else
+            for(std::size_t j = 0; j<sources[i].size(); j++)
+                faces.push_back(soup.faces[sources[i][j]]);
+    }
+    
+    //The vertices which are no longer used are removed.
+    std::vector<std::size_t> index(soup.points.size()/3, 0);
+    for(std::size_t i = 0; i<faces.size(); i++)
+        for(std::size_t j = 0; j<faces[i].size(); j++)
+            index[faces[i][j]] = 1;
+    std::vector<double> points;
+    for(std::size_t v = 0; v<index.size(); v++){
+        if(!index[v]) continue;
+        index[v] = points.size()/3;
+        points.insert(points.end(), soup.points.begin()+3*v, soup.points.begin()+3*v+3);
+    }
+    for(std::size_t i = 0; i<faces.size(); i++)
+        for(std::size_t j = 0; j<faces[i].size(); j++)
+            faces[i][j] = index[faces[i][j]];
+    soup.points.swap(points);
+    soup.faces.swap(faces);
+}
+
+//A buffered file used by every writer. Binary values are written in the byte order of the machine,
+//which is little endian (as PLY, STL and glTF need) on every platform the program is built for.
+class Output_buffer{
+public:
+    //The file is removed first, so a mesh hard linked from the mesh cache is replaced, not written through.
+    Output_buffer(std::string file_name){
+        std::remove(file_name.c_str());
+        out.open(file_name, std::ios::binary);
+        buffer.reserve(capacity);
+    }
+    ~Output_buffer(){ flush(); }
+    
+    template<class T> void put(T value){
+        const char* bytes = reinterpret_cast<const char*>(&value);
+        buffer.insert(buffer.end(), bytes, bytes+sizeof(T));
+        if(buffer.size()>=capacity) flush();
+    }
+    void text(const std::string& line){
+        buffer.insert(buffer.end(), line.begin(), line.end());
+        if(buffer.size()>=capacity) flush();
+    }
+    void flush(){
+        out.write(buffer.data(), buffer.size());
+        buffer.clear();
+    }
+    
+private:
+    static const std::size_t capacity = 1<<20;
+    std::ofstream out;
+    std::vector<char> buffer;
+};
+
+//The writers receive the counts (and bounding box, for glTF) first, then every vertex, then every face.
+class Mesh_writer{
+public:
+    virtual ~Mesh_writer(){}
+    virtual bool triangles() const{ return false; }
+    virtual void begin(std::size_t vertex_count, std::size_t face_count, const double bbox[6]) = 0;
+    virtual void vertex(double x, double y, double z) = 0;
+    virtual void face(const std::vector<std::size_t>& face) = 0;
+    virtual void end(){}
+};
+
+//The original text .OFF format.
+class Off_writer : public Mesh_writer{
+public:
+    Off_writer(std::string file_name) : out(file_name){}
+    void begin(std::size_t vertex_count, std::size_t face_count, const double*){
+        out.text("OFF\n"+std::to_string(vertex_count)+" "+std::to_string(face_count)+" 0\n");
+    }
+    void vertex(double x, double y, double z){
+        char line[96];
+        snprintf(line, sizeof(line), "%g %g %g\n", x, y, z);
+        out.text(line);
+    }
+    void face(const std::vector<std::size_t>& face){
+        std::string line = std::to_string(face.size());
+        for(std::size_t i = 0; i<face.size(); i++)
+            line+=" "+std::to_string(face[i]);
+        out.text(line+"\n");
+    }
+private:
+    Output_buffer out;
+};
+
+//Binary little endian .PLY, with float vertices and a uint/uint face list (the merged faces of
+//--optimize-mesh and the facets of a Nef can have more than 255 vertices).
+class Ply_writer : public Mesh_writer{
+public:
+    Ply_writer(std::string file_name) : out(file_name){}
+    void begin(std::size_t vertex_count, std::size_t face_count, const double*){
+        out.text("ply\nformat binary_little_endian 1.0\n");
+        out.text("element vertex "+std::to_string(vertex_count)+"\nproperty float x\nproperty float y\nproperty float z\n");
+        out.text("element face "+std::to_string(face_count)+"\nproperty list uint uint vertex_indices\nend_header\n");
+    }
+    void vertex(double x, double y, double z){
+        out.put(static_cast<float>(x));
+        out.put(static_cast<float>(y));
+        out.put(static_cast<float>(z));
+    }
+    void face(const std::vector<std::size_t>& face){
+        out.put(static_cast<unsigned int>(face.size()));
+        for(std::size_t i = 0; i<face.size(); i++)
+            out.put(static_cast<unsigned int>(face[i]));
+    }
+private:
+    Output_buffer out;
+};
+
+//Binary .STL. STL has no shared vertices, so the vertices are kept (as floats) until the faces
+//are written as triangles.
+class Stl_writer : public Mesh_writer{
+public:
+    Stl_writer(std::string file_name) : out(file_name){}
+    bool triangles() const{ return true; }
+    void begin(std::size_t, std::size_t face_count, const double*){
+        out.text(std::string(80, ' '));
+        out.put(static_cast<unsigned int>(face_count));
+    }
+    void vertex(double x, double y, double z){
+        points.push_back(x);
+        points.push_back(y);
+        points.push_back(z);
+    }
+    void face(const std::vector<std::size_t>& face){
+        const float* a = &points[3*face[0]];
+        const float* b = &points[3*face[1]];
+        const float* c = &points[3*face[2]];
+        float u[3] = {b[0]-a[0], b[1]-a[1], b[2]-a[2]};
+        float v[3] = {c[0]-a[0], c[1]-a[1], c[2]-a[2]};
+        float n[3] = {u[1]*v[2]-u[2]*v[1], u[2]*v[0]-u[0]*v[2], u[0]*v[1]-u[1]*v[0]};
+        float length = std::sqrt(n[0]*n[0]+n[1]*n[1]+n[2]*n[2]);
+        for(int i = 0; i<3; i++) out.put(length>0 ? n[i]/length : 0.0f);
+        for(int i = 0; i<3; i++) out.put(a[i]);
+        for(int i = 0; i<3; i++) out.put(b[i]);
+        for(int i = 0; i<3; i++) out.put(c[i]);
+        out.put(static_cast<unsigned short>(0));
+    }
+private:
+    Output_buffer out;
+    std::vector<float> points;
+};
+
+//Binary glTF (.glb) with a single mesh. The JSON chunk only depends on the counts and bounding box,
+//so the vertices (floats) and then the indices (uints) are streamed straight into the binary chunk.
+class Glb_writer : public Mesh_writer{
+public:
+    Glb_writer(std::string file_name) : out(file_name){}
+    bool triangles() const{ return true; }
+    void begin(std::size_t vertex_count, std::size_t face_count, const double bbox[6]){
+        std::size_t vertex_bytes = vertex_count*12;
+        std::size_t index_bytes = face_count*12;
+        std::ostringstream json;
+        json.precision(9); //Enough for the min/max to match the float vertices exactly.
+        json << "{\"asset\":{\"version\":\"2.0\"},\"scene\":0,\"scenes\":[{\"nodes\":[0]}],\"nodes\":[{\"mesh\":0}],"
+             << "\"meshes\":[{\"primitives\":[{\"attributes\":{\"POSITION\":0},\"indices\":1}]}],"
+             << "\"buffers\":[{\"byteLength\":" << vertex_bytes+index_bytes << "}],"
+             << "\"bufferViews\":[{\"buffer\":0,\"byteOffset\":0,\"byteLength\":" << vertex_bytes << ",\"target\":34962},"
+             << "{\"buffer\":0,\"byteOffset\":" << vertex_bytes << ",\"byteLength\":" << index_bytes << ",\"target\":34963}],"
+             << "\"accessors\":[{\"bufferView\":0,\"componentType\":5126,\"count\":" << vertex_count << ",\"type\":\"VEC3\","
+             << "\"min\":[" << static_cast<float>(bbox[0]) << "," << static_cast<float>(bbox[1]) << "," << static_cast<float>(bbox[2]) << "],"
+             << "\"max\":[" << static_cast<float>(bbox[3]) << "," << static_cast<float>(bbox[4]) << "," << static_cast<float>(bbox[5]) << "]},"
+             << "{\"bufferView\":1,\"componentType\":5125,\"count\":" << face_count*3 << ",\"type\":\"SCALAR\"}]}";
+        std::string header = json.str();
+        //The JSON chunk is padded with spaces to 4 bytes. Both binary parts are already multiples of 4.
+        while(header.size()%4) header+=' ';
+        
+        out.put(static_cast<unsigned int>(0x46546C67)); //"glTF"
+        out.put(static_cast<unsigned int>(2));
+        out.put(static_cast<unsigned int>(12+8+header.size()+8+vertex_bytes+index_bytes));
+        out.put(static_cast<unsigned int>(header.size()));
+        out.put(static_cast<unsigned int>(0x4E4F534A)); //"JSON"
+        out.text(header);
+        out.put(static_cast<unsigned int>(vertex_bytes+index_bytes));
+        out.put(static_cast<unsigned int>(0x004E4942)); //"BIN"
+    }
+    void vertex(double x, double y, double z){
+        out.put(static_cast<float>(x));
+        out.put(static_cast<float>(y));
+        out.put(static_cast<float>(z));
+    }
+    void face(const std::vector<std::size_t>& face){
+        for(int i = 0; i<3; i++)
+            out.put(static_cast<unsigned int>(face[i]));
+    }
+private:
+    Output_buffer out;
+};
+
+//Wavefront .OBJ, as text. Its faces index the vertices from 1, and it can hold several named objects,
+//so it is also used to stream the parts of a building one after another (see Mesh_stream).
+class Obj_writer : public Mesh_writer{
+public:
+    Obj_writer(std::string file_name) : out(file_name){}
+    void begin(std::size_t vertex_count, std::size_t face_count, const double*){
+        out.text("# "+std::to_string(vertex_count)+" vertices, "+std::to_string(face_count)+" faces\n");
+    }
+    void object(const std::string& name){
+        out.text("o "+name+"\n");
+    }
+    void vertex(double x, double y, double z){
+        char line[96];
+        snprintf(line, sizeof(line), "v %g %g %g\n", x, y, z);
+        out.text(line);
+    }
+    void face(const std::vector<std::size_t>& face){
+        std::string line = "f";
+        for(std::size_t i = 0; i<face.size(); i++)
+            line+=" "+std::to_string(face[i]+1);
+        out.text(line+"\n");
+    }
+private:
+    Output_buffer out;
+};
+
+//This changes the extension of the file name to match the chosen format.
+void mesh_file_name(std::string& file_name){
+    std::size_t extension = file_name.rfind(".off");
+    if(extension!=std::string::npos && extension+4==file_name.size())
+        file_name = file_name.substr(0, extension)+"."+mesh_format;
+}
+
+//This returns the writer for the chosen format, and changes the extension of the file name to match.
+std::unique_ptr<Mesh_writer> make_mesh_writer(std::string& file_name){
+    mesh_file_name(file_name);
+    
+    if(!mesh_format.compare("ply")) return std::unique_ptr<Mesh_writer>(new Ply_writer(file_name));
+    if(!mesh_format.compare("stl")) return std::unique_ptr<Mesh_writer>(new Stl_writer(file_name));
+    if(!mesh_format.compare("glb")) return std::unique_ptr<Mesh_writer>(new Glb_writer(file_name));
+    if(!mesh_format.compare("obj")) return std::unique_ptr<Mesh_writer>(new Obj_writer(file_name));
+    return std::unique_ptr<Mesh_writer>(new Off_writer(file_name));
+}
+
+//An assembly converted for writing: each distinct prototype is converted only once into a soup, and
+//every instance keeps the soup of its prototype and its transformation as a 3x4 matrix of doubles.
+//The solid itself comes first, with the identity. With --optimize-mesh, each soup is optimized once,
+//and the counts it would have been written with are kept for the report.
+struct Assembly_soup{
+    std::vector<Mesh_soup> soups;
+    std::vector<std::size_t> soup_index;
+    std::vector<std::array<double, 12> > matrices;
+    std::size_t vertices_before;
+    std::size_t faces_before;
+    
+    const Mesh_soup& soup(std::size_t i) const{ return soups[soup_index[i]]; }
+};
+
+template<class Solid>
+void convert_assembly(const Assembly<Solid>& assembly, bool triangles, Assembly_soup& converted){
+    converted.soups.assign(1, Mesh_soup());
+    convert_to_soup(assembly.nef, converted.soups[0], triangles);
+    converted.soup_index.assign(1, 0);
+    converted.matrices.assign(1, {{1,0,0,0, 0,1,0,0, 0,0,1,0}});
+    
+    std::map<const Solid*, std::size_t> prototype_soup;
+    for(std::size_t i = 0; i<assembly.instances.size(); i++){
+        const Solid* prototype = assembly.instances[i].prototype.get();
+        if(prototype_soup.find(prototype)==prototype_soup.end()){
+            prototype_soup[prototype] = converted.soups.size();
+            converted.soups.push_back(Mesh_soup());
+            convert_to_soup(*prototype, converted.soups.back(), triangles);
+        }
+        converted.soup_index.push_back(prototype_soup[prototype]);
+        
+        std::array<double, 12> matrix;
+        const typename Solid::Aff_transformation_3& t = assembly.instances[i].transformation;
+        for(int r = 0; r<3; r++)
+            for(int c = 0; c<4; c++)
+                matrix[r*4+c] = CGAL::to_double(t.m(r, c));
+        converted.matrices.push_back(matrix);
+    }
+    
+    converted.vertices_before = 0;
+    converted.faces_before = 0;
+    for(std::size_t i = 0; i<converted.matrices.size(); i++){
+        converted.vertices_before+=converted.soup(i).points.size()/3;
+        converted.faces_before+=output_faces(converted.soup(i), triangles);
+    }
+    if(optimize_mesh)
+        for(std::size_t i = 0; i<converted.soups.size(); i++)
+            optimize_soup(converted.soups[i], triangles);
+}
+
+//This writes the vertices of every instance, with its transformation applied.
+void write_vertices(const Assembly_soup& converted, Mesh_writer& writer){
+    for(std::size_t i = 0; i<converted.matrices.size(); i++){
+        const Mesh_soup& soup = converted.soup(i);
+        const std::array<double, 12>& m = converted.matrices[i];
+        for(std::size_t j = 0; j<soup.points.size(); j+=3){
+            const double* p = &soup.points[j];
+            writer.vertex(m[0]*p[0]+m[1]*p[1]+m[2]*p[2]+m[3], m[4]*p[0]+m[5]*p[1]+m[6]*p[2]+m[7], m[8]*p[0]+m[9]*p[1]+m[10]*p[2]+m[11]);
+        }
+    }
+}
+
+//This writes the faces of every instance in the same order as the vertices, each offset by the vertices
+//written before it. For formats which only store triangles, each face is split into a fan of triangles.
+void write_faces(const Assembly_soup& converted, Mesh_writer& writer, std::size_t offset){
+    bool triangles = writer.triangles();
+    std::vector<std::size_t> face;
+    for(std::size_t i = 0; i<converted.matrices.size(); i++){
+        const Mesh_soup& soup = converted.soup(i);
+        for(std::size_t j = 0; j<soup.faces.size(); j++){
+            const std::vector<std::size_t>& polygon = soup.faces[j];
+            if(triangles){
+                for(std::size_t k = 1; k+1<polygon.size(); k++){
+                    face.assign({offset+polygon[0], offset+polygon[k], offset+polygon[k+1]});
+                    writer.face(face);
                 }
-                remove_windows_line+=")";
-                if(i<remove_windows.size()-1) remove_windows_line+=",";
             }
-            output_file << remove_windows_line+"\n";
+            else{
+                face.clear();
+                for(std::size_t k = 0; k<polygon.size(); k++)
+                    face.push_back(offset+polygon[k]);
+                writer.face(face);
+            }
         }
+        offset+=soup.points.size()/3;
+    }
+}
+
+//This function writes an assembly to the mesh file. Each distinct prototype is converted only once,
+//and every instance then writes the prototype's vertices with its transformation applied.
+template<class Solid>
+void write_assembly(const Assembly<Solid>& assembly, std::string& file_name){
+    Stage_timer timer("write");
+    std::unique_ptr<Mesh_writer> writer = make_mesh_writer(file_name);
+    bool triangles = writer->triangles();
+    
+    Assembly_soup converted;
+    convert_assembly(assembly, triangles, converted);
+    
+    std::size_t vertex_count = 0;
+    std::size_t face_count = 0;
+    double bbox[6] = {0,0,0,0,0,0};
+    for(std::size_t i = 0; i<converted.matrices.size(); i++){
+        const Mesh_soup& soup = converted.soup(i);
+        vertex_count+=soup.points.size()/3;
+        face_count+=output_faces(soup, triangles);
         
-        if(railing_parameters.size()>0){
-            std::string railing_line = "Railings = ";
-            for(int i =0;i< railing_parameters.size(); i++){
-                railing_line+="(";
-                
-                for(int j=0; j<3; j++){
-                    railing_line+=std::to_string(railing_parameters[i][j]);
-                    if(j<2) railing_line+=",";
-                }
-                railing_line+=")";
-                if(i<railing_parameters.size()-1) railing_line+=",";
+        //The bounding box is only needed by glTF, but it is cheap compared to writing the vertices.
+        const std::array<double, 12>& m = converted.matrices[i];
+        for(std::size_t j = 0; j<soup.points.size(); j+=3){
+            for(int r = 0; r<3; r++){
+                double value = m[r*4]*soup.points[j]+m[r*4+1]*soup.points[j+1]+m[r*4+2]*soup.points[j+2]+m[r*4+3];
+                if(bbox[r]>value || j+i==0) bbox[r] = value;
+                if(bbox[r+3]<value || j+i==0) bbox[r+3] = value;
             }
-            output_file << railing_line+"\n";
         }
+    }
+    
+    profile_count("output vertices", vertex_count);
+    profile_count(triangles ? "output triangles" : "output faces", face_count);
+    if(optimize_mesh)
+        Log_line(LOG_SUMMARY) << "Optimized " << file_name << ": " << converted.vertices_before << " -> " << vertex_count << " vertices, " << converted.faces_before << " -> " << face_count << (triangles ? " triangles" : " faces");
+    writer->begin(vertex_count, face_count, bbox);
+    write_vertices(converted, *writer);
+    write_faces(converted, *writer, 0);
+    writer->end();
+}
+
+//With --stream, the building is not merged into one solid before it is written. Its shell and each of
+//its facades are converted as soon as they are generated, appended to an .OBJ file as their own named
+//object, and then freed, so only the parts being generated are held in memory. The parts are written
+//in the order they finish, by whichever thread finished them. The offset moves every part up as the
+//whole building would have been.
+class Mesh_stream{
+public:
+    Mesh_stream(std::string& file_name, double z_offset) : z_offset(z_offset), vertex_count(0), face_count(0), vertices_before(0), faces_before(0){
+        mesh_file_name(file_name);
+        writer.reset(new Obj_writer(file_name));
+        this->file_name = file_name;
+    }
+    ~Mesh_stream(){
+        profile_count("output vertices", vertex_count);
+        profile_count("output faces", face_count);
+        if(optimize_mesh)
+            Log_line(LOG_SUMMARY) << "Optimized " << file_name << ": " << vertices_before << " -> " << vertex_count << " vertices, " << faces_before << " -> " << face_count << " faces";
+    }
+    
+    template<class Solid>
+    void write(const std::string& name, const Assembly<Solid>& assembly){
+        Stage_timer timer("write");
+        Assembly_soup converted;
+        convert_assembly(assembly, false, converted);
+        for(std::size_t i = 0; i<converted.matrices.size(); i++)
+            converted.matrices[i][11]+=z_offset;
         
-        output_file.close();
+        std::lock_guard<std::mutex> guard(lock);
+        writer->object(name);
+        write_vertices(converted, *writer);
+        write_faces(converted, *writer, vertex_count);
+        for(std::size_t i = 0; i<converted.matrices.size(); i++){
+            vertex_count+=converted.soup(i).points.size()/3;
+            face_count+=converted.soup(i).faces.size();
+        }
+        vertices_before+=converted.vertices_before;
+        faces_before+=converted.faces_before;
     }
-    else std::cout << "Unable to open file";
     
+private:
+    std::mutex lock;
+    std::unique_ptr<Obj_writer> writer;
+    std::string file_name;
+    double z_offset;
+    std::size_t vertex_count;
+    std::size_t face_count;
+    std::size_t vertices_before;
+    std::size_t faces_before;
+};
+
+//This returns the file name of level i out of count levels of detail, with _lod<N> before the extension
+//if there are several.
+std::string level_file_name(const std::string& file_name, std::size_t i, std::size_t count){
+    if(count<=1) return file_name;
+    std::size_t extension = file_name.rfind('.');
+    return file_name.substr(0, extension)+"_lod"+std::to_string(i)+file_name.substr(extension);
+}
+
+//------------------------------MESH CACHE--------------------------
+
+//With --mesh-cache DIR, the meshes of each building are kept in DIR under a hash of its resolved
+//parameters (after the ranges and random values are drawn), together with the options which change
+//the mesh. A later building with the same resolved parameters, in this run or another, isn't generated
+//at all: its files are hard linked (or copied) from the cache. Each entry is a directory holding the
+//key it was stored under (which is compared on a hit, so a hash collision is only a miss) and the mesh
+//of each level of detail. The cache is kept under --mesh-cache-size megabytes by removing the entries
+//used the longest time ago, as each hit updates the time of its key file.
+std::mutex mesh_cache_lock;
+std::atomic<long> mesh_cache_writes(0);
+
+//The key and file name of a building in the cache, and whether its meshes were taken from it.
+struct Mesh_cache_entry{
+    std::string key;
+    std::string file_name;
+    bool hit = false;
+};
+
+//The doubles are written exactly (in hexadecimal), and the parameters which the shape doesn't use
+//are left out, so they don't make two identical buildings different.
+std::string building_key(const std::vector<std::vector <int> >& remove_windows, int sides, int shape_type, double building_parameters[], const std::vector <std::vector <int> >& railing_parameters, double grid_bottom_parameters[], double grid_center_parameters[], double grid_top_parameters[], double window_scale_parameters[], double window_design_parameters[], double door_parameters[], double vertical_offset, double overhang_parameters[]){
+    std::ostringstream key;
+    auto exact = [&](const char* name, double value){
+        char number[64];
+        snprintf(number, sizeof(number), "%a", value);
+        key << name << " = " << number << "\n";
+    };
+    
+    key << "Mesh Cache = 1\n";
+    key << "Backend = " << (fast_backend ? "fast" : csg ? "csg" : eager_transforms ? "eager" : "exact") << "\n";
+    key << "Options = " << instancing << facade_2d << lod_output << chain_unions << prototype_caching << optimize_mesh << stream_output << " " << fn << " " << lod_fn << " " << mesh_format << "\n";
+    exact("Prototype Cache Quantum", cache_quantum);
+    exact("Weld Tolerance", weld_tolerance);
+    exact("Snap", snap_grid);
+    
+    key << "Shape Type = " << shape_type << "\n";
+    key << "Sides = " << (shape_type==2 ? sides : 0) << "\n";
+    exact("Building Width 1", building_parameters[0]);
+    exact("Building Length 1", shape_type==2 ? 0 : building_parameters[1]);
+    exact("Building Width 2", shape_type==3 ? building_parameters[2] : 0);
+    exact("Building Length 2", shape_type==3 ? building_parameters[3] : 0);
+    exact("Building Height", building_parameters[4]);
+    for(int i = 0; i<3; i++) exact("Overhang", overhang_parameters[i]);
+    for(int i = 0; i<6; i++) exact("Window Scale", window_scale_parameters[i]);
+    
+    //The rectangle only uses the first two sides of each grid (the polygon's are already all the first).
+    for(int i = 0; i<8; i++){
+        bool used = shape_type!=1 || i<2 || i>=6;
+        exact("Grid Bottom", used ? grid_bottom_parameters[i] : 0);
+        exact("Grid Centre", used ? grid_center_parameters[i] : 0);
+        exact("Grid Top", used ? grid_top_parameters[i] : 0);
+    }
+    exact("Vertical Offset", vertical_offset);
+    for(int i = 0; i<3; i++) exact("Window Design", window_design_parameters[i]);
+    for(int i = 0; i<3; i++) exact("Door", door_parameters[i]);
+    
+    //The order of the removed windows doesn't matter, but the first railing of a row is the one used.
+    std::vector<std::vector<int> > removed = remove_windows;
+    std::sort(removed.begin(), removed.end());
+    removed.erase(std::unique(removed.begin(), removed.end()), removed.end());
+    key << "Remove Window =";
+    for(std::size_t i = 0; i<removed.size(); i++)
+        key << " (" << removed[i][0] << "," << removed[i][1] << "," << removed[i][2] << ")";
+    key << "\nRailings =";
+    for(std::size_t i = 0; i<railing_parameters.size(); i++)
+        key << " (" << railing_parameters[i][0] << "," << railing_parameters[i][1] << "," << railing_parameters[i][2] << ")";
+    key << "\n";
+    return key.str();
+}
+
+//The hash of a key (64 bit FNV-1a), as the name of its entry.
+std::string key_hash(const std::string& key){
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    for(std::size_t i = 0; i<key.size(); i++){
+        hash^=static_cast<unsigned char>(key[i]);
+        hash*=0x100000001b3ULL;
+    }
+    char name[17];
+    snprintf(name, sizeof(name), "%016llx", hash);
+    return name;
+}
+
+//This returns the names of the mesh files of a building, one for each level of detail.
+std::vector<std::string> mesh_file_names(const std::string& file_name){
+    std::size_t count = lod_output ? 4 : 1;
+    std::vector<std::string> names;
+    for(std::size_t i = 0; i<count; i++){
+        names.push_back(level_file_name(file_name, i, count));
+        mesh_file_name(names.back());
+    }
+    return names;
+}
+
+std::string read_file(const std::string& file_name){
+    std::ifstream in(file_name, std::ios::binary);
+    return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+}
+
+bool copy_file(const std::string& from, const std::string& to){
+    std::ifstream in(from, std::ios::binary);
+    std::ofstream out(to, std::ios::binary);
+    if(!in.is_open() || !out.is_open()) return false;
+    out << in.rdbuf();
+    return static_cast<bool>(out);
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+
+//The files in a directory (without . and ..).
+std::vector<std::string> directory_files(const std::string& directory){
+    std::vector<std::string> files;
+    DIR* dir = opendir(directory.c_str());
+    if(!dir) return files;
+    while(dirent* entry = readdir(dir)){
+        std::string name = entry->d_name;
+        if(name.compare(".") && name.compare("..")) files.push_back(name);
+    }
+    closedir(dir);
+    return files;
+}
+
+void remove_directory(const std::string& directory){
+    std::vector<std::string> files = directory_files(directory);
+    for(std::size_t i = 0; i<files.size(); i++)
+        unlink((directory+"/"+files[i]).c_str());
+    rmdir(directory.c_str());
+}
+
+//This links (or copies) the cached meshes of the key onto the files of the building, returning false
+//if the key isn't cached.
+bool restore_cached_mesh(const std::string& key, const std::string& file_name){
+    std::string entry = mesh_cache_dir+"/"+key_hash(key);
+    if(read_file(entry+"/key.txt")!=key) return false;
+    
+    std::vector<std::string> names = mesh_file_names(file_name);
+    for(std::size_t i = 0; i<names.size(); i++){
+        std::string cached = entry+"/"+std::to_string(i);
+        unlink(names[i].c_str());
+        if(link(cached.c_str(), names[i].c_str())!=0 && !copy_file(cached, names[i])) return false;
+    }
+    utime((entry+"/key.txt").c_str(), NULL);
+    return true;
+}
+
+//This removes the entries used the longest time ago until the cache fits in its size.
+void evict_mesh_cache(){
+    std::vector<std::pair<time_t, std::string> > entries;
+    double total = 0;
+    std::vector<std::string> hashes = directory_files(mesh_cache_dir);
+    for(std::size_t i = 0; i<hashes.size(); i++){
+        std::string entry = mesh_cache_dir+"/"+hashes[i];
+        struct stat info;
+        if(hashes[i].find('.')!=std::string::npos || stat((entry+"/key.txt").c_str(), &info)!=0) continue;
+        entries.push_back(std::make_pair(info.st_mtime, entry));
+        
+        std::vector<std::string> files = directory_files(entry);
+        for(std::size_t j = 0; j<files.size(); j++)
+            if(stat((entry+"/"+files[j]).c_str(), &info)==0) total+=info.st_size;
+    }
     
+    std::sort(entries.begin(), entries.end());
+    for(std::size_t i = 0; i<entries.size() && total>mesh_cache_limit*1024*1024; i++){
+        std::vector<std::string> files = directory_files(entries[i].second);
+        struct stat info;
+        for(std::size_t j = 0; j<files.size(); j++)
+            if(stat((entries[i].second+"/"+files[j]).c_str(), &info)==0) total-=info.st_size;
+        remove_directory(entries[i].second);
+        profile_count("mesh cache evictions", 1);
+    }
+}
+
+//This copies the meshes of a building into the cache. The entry is filled under a temporary name and
+//then renamed, so a concurrent run never sees it half written.
+void store_cached_mesh(const std::string& key, const std::string& file_name){
+    std::string entry = mesh_cache_dir+"/"+key_hash(key);
+    std::string temporary = entry+"."+std::to_string(getpid())+"."+std::to_string(mesh_cache_writes++);
+    mkdir(mesh_cache_dir.c_str(), 0777);
+    if(mkdir(temporary.c_str(), 0777)!=0) return;
+    
+    std::vector<std::string> names = mesh_file_names(file_name);
+    bool stored = true;
+    for(std::size_t i = 0; i<names.size() && stored; i++)
+        stored = copy_file(names[i], temporary+"/"+std::to_string(i));
+    std::ofstream(temporary+"/key.txt", std::ios::binary) << key;
+    
+    //If the entry already exists (from another building with the same key), it is kept as it is.
+    if(!stored || rename(temporary.c_str(), entry.c_str())!=0) remove_directory(temporary);
+    
+    std::lock_guard<std::mutex> guard(mesh_cache_lock);
+    evict_mesh_cache();
+}
+
+#else
+
+//The cache needs hard links and directories, so it is only used on Unix.
+bool restore_cached_mesh(const std::string&, const std::string&){ return false; }
+void store_cached_mesh(const std::string&, const std::string&){}
+
+#endif
+
+//------------------------------BUILDING GENERATION--------------------------
+
+//This returns the file name of a building (before the extension of the format is set).
+std::string building_file_name(int shape_type, int num){
+    if(shape_type==1) return "DSRI_CGAL_mesh_rectangle_"+std::to_string(num)+".off";
+    if(shape_type==2) return "DSRI_CGAL_mesh_polygon_"+std::to_string(num)+".off";
+    if(shape_type==3) return "DSRI_CGAL_mesh_L.off_"+std::to_string(num)+".off";
+    if(shape_type==4) return "DSRI_CGAL_mesh_TEST.off_"+std::to_string(num)+".off";
+    return "";
 }
+
 //This function handles the actual grammar/pipeline creation for the building.
 //Here, it checks the shape type and calls the corresponding functions as well as
-//rename the file_name variable.
+//rename the file_name variable (which is passed back, as several buildings can be generated at once).
+//It returns the building at full detail or, with --lod, at each level of detail from 0 to 3. The
+//shape (with its overhang) is only generated once and shared by every level: level 0 is the shape
+//alone, and the other levels add the facades at their level of detail, generated as tasks.
+//With --stream, each level is written to its own stream instead (the shell, then each facade as it is
+//placed), and the returned levels are empty. The file name is then set to the full detail file.
 
-Nef_polyhedron grammar(std::vector < std::vector<int>> remove_windows, int sides, int shape_type, double building_parameters[],std::vector <std::vector <int> > railing_parameters, double grid_bottom_parameters[], double grid_center_parameters[], double grid_top_parameters[], double window_scale_parameters[], double  window_design_parameters[], double door_parameters[], double vertical_offset, double overhang_parameters[], int num){
-    Nef_polyhedron nef;
+template<class Solid>
+std::vector<Assembly<Solid> > grammar(const std::vector < std::vector<int>>& remove_windows, int sides, int shape_type, double building_parameters[],const std::vector <std::vector <int> >& railing_parameters, double grid_bottom_parameters[], double grid_center_parameters[], double grid_top_parameters[], double window_scale_parameters[], double  window_design_parameters[], double door_parameters[], double vertical_offset, double overhang_parameters[], int num, std::string& file_name, Tile_counts& counts){
+    Stage_timer timer("grammar");
+    Assembly<Solid> shape;
+    file_name = building_file_name(shape_type, num);
     
     if(shape_type==1){
-        std::cout <<"Rectangular Cube, sides: " << 2 << ", grid height: " << grid_top_parameters[6] << std::endl;
-        file_name = "DSRI_CGAL_mesh_rectangle_"+std::to_string(num)+".off";
-        Nef_polyhedron nef_building = gen_rectangle(building_parameters, overhang_parameters);
-        Nef_polyhedron nef_window = facade_grammar(remove_windows, sides, shape_type, building_parameters, railing_parameters, grid_bottom_parameters,grid_center_parameters, grid_top_parameters, window_scale_parameters, window_design_parameters, door_parameters, vertical_offset);
-        nef= nef_building+nef_window;
+        Log_line(LOG_SUMMARY) << "Building " << num << ": " <<"Rectangular Cube, sides: " << 2 << ", grid height: " << grid_top_parameters[6];
+        shape += gen_rectangle<Solid>(building_parameters, overhang_parameters);
         
     }
     else if(shape_type==2){
-        std::cout <<"Polygon, sides " << sides << ", grid height: " << grid_top_parameters[6] << std::endl;
-        file_name = "DSRI_CGAL_mesh_polygon_"+std::to_string(num)+".off";
-        Nef_polyhedron nef_building = gen_polygon(building_parameters, overhang_parameters, sides);
-        Nef_polyhedron nef_window =facade_grammar(remove_windows, sides, shape_type, building_parameters, railing_parameters, grid_bottom_parameters,grid_center_parameters, grid_top_parameters, window_scale_parameters, window_design_parameters, door_parameters, vertical_offset);
-        nef= nef_building+nef_window;
+        Log_line(LOG_SUMMARY) << "Building " << num << ": " <<"Polygon, sides " << sides << ", grid height: " << grid_top_parameters[6];
+        shape += gen_polygon<Solid>(building_parameters, overhang_parameters, sides);
     }
     
     else if(shape_type ==3){
-        std::cout <<"L Shape, sides " << 6 << ", grid height: " << grid_top_parameters[6] << std::endl;
-        file_name = "DSRI_CGAL_mesh_L.off_"+std::to_string(num)+".off";
-        Nef_polyhedron nef_building = gen_L(building_parameters, overhang_parameters);
-        Nef_polyhedron nef_window =facade_grammar(remove_windows, sides, shape_type, building_parameters, railing_parameters, grid_bottom_parameters,grid_center_parameters, grid_top_parameters, window_scale_parameters, window_design_parameters, door_parameters, vertical_offset);
-        nef= nef_building+nef_window;
+        Log_line(LOG_SUMMARY) << "Building " << num << ": " <<"L Shape, sides " << 6 << ", grid height: " << grid_top_parameters[6];
+        shape += gen_L<Solid>(building_parameters, overhang_parameters);
     }
     
     //NOTE: Use this if you are testing the program.
     else if(shape_type ==4){//TESTING
-        file_name = "DSRI_CGAL_mesh_TEST.off_"+std::to_string(num)+".off";
         
     }
-    //This centers the building so it can be placed on a ground without any other resource.
-    //Remove if you wish the building is to be centered on (0,0,0).
-    translate(0,0, building_parameters[4]/2, nef);
-    return nef;
+    
+    std::vector<int> lods;
+    if(lod_output) lods = {0, 1, 2, 3};
+    else lods = {3};
+    
+    std::vector<std::unique_ptr<Mesh_stream> > streams;
+    if(stream_output){
+        std::string base_name = file_name;
+        for(std::size_t i = 0; i<lods.size(); i++){
+            file_name = level_file_name(base_name, i, lods.size());
+            streams.push_back(std::unique_ptr<Mesh_stream>(new Mesh_stream(file_name, building_parameters[4]/2)));
+            streams[i]->write("shell", shape);
+        }
+        shape = Assembly<Solid>();
+    }
+    
+    std::vector<Assembly<Solid> > levels(lods.size(), shape);
+    Task_group group(task_pool);
+    for(std::size_t i = 0; i<lods.size(); i++)
+        group.run([&, i](){
+            std::function<void(std::size_t, const Assembly<Solid>&)> stream;
+            if(stream_output)
+                stream = [&, i](std::size_t side, const Assembly<Solid>& facade){ streams[i]->write("facade_"+std::to_string(side), facade); };
+            
+            if(lods[i]>0 && shape_type>=1 && shape_type<=3)
+                levels[i] += facade_grammar<Solid>(remove_windows, sides, shape_type, building_parameters, railing_parameters, grid_bottom_parameters,grid_center_parameters, grid_top_parameters, window_scale_parameters, window_design_parameters, door_parameters, vertical_offset, lods[i], lods[i]==3 ? &counts : NULL, stream);
+            
+            //This centers the building so it can be placed on a ground without any other resource.
+            //Remove if you wish the building is to be centered on (0,0,0).
+            translate(0,0, building_parameters[4]/2, levels[i]);
+        });
+    group.wait();
+    return levels;
 }
 
 //This function handles the parameter mangement of the building,
 //and creates the parameters to be used as well as read from the input file,
 //and finally calls the buidling generation.
-Nef_polyhedron parameter_management(int num, std::string input_file){
+template<class Solid>
+std::vector<Assembly<Solid> > parameter_management(int num, std::string input_file, std::string& file_name, Random& random, unsigned long long seed, Tile_counts& counts, Cost_estimate* estimate = NULL, Mesh_cache_entry* cache = NULL){
+    Stage_timer timer("parameters");
     
     //These values are the default ranges used (If the input file is empty).
     int shape_range[2] ={2,2};
@@ -1142,79 +4077,77 @@ Nef_polyhedron parameter_management(int num, std::string input_file){
     
     //The below code generates a random number for each parameter.
     int shape_type;
-    if(shape_range[0] ==-1)shape_type = randINum(1, 3); else shape_type = randINum(shape_range[0], shape_range[1]);
+    if(shape_range[0] ==-1)shape_type = randINum(random, 1, 3); else shape_type = randINum(random, shape_range[0], shape_range[1]);
     
     int sides=4;
     while(sides==4)
-        if(side_range[0]==-1)sides = randINum(3, 6); else sides=randINum(side_range[0], side_range[1]);
+        if(side_range[0]==-1)sides = randINum(random, 3, 6); else sides=randINum(random, side_range[0], side_range[1]);
     
     double building_parameters[5];//{width1, length1, width2, length2, height}
-    if(building_range[0] ==-1)building_parameters[0] = randDNum(100, 1000);else building_parameters[0] = randDNum(building_range[0], building_range[1]);
-    if(building_range[2] ==-1)building_parameters[1] = randDNum(100, 1000);else building_parameters[1] = randDNum(building_range[2], building_range[3]);
-    if(building_range[4] ==-1)building_parameters[2] = randDNum(100, 1000);else building_parameters[2] = randDNum(building_range[4], building_range[5]);
-    if(building_range[6] ==-1)building_parameters[3] = randDNum(100, 1000);else building_parameters[3] = randDNum(building_range[6], building_range[7]);
-    if(building_range[8] ==-1)building_parameters[4] = randDNum(100, 1000);else building_parameters[4] = randDNum(building_range[8], building_range[9]);
+    if(building_range[0] ==-1)building_parameters[0] = randDNum(random, 100, 1000);else building_parameters[0] = randDNum(random, building_range[0], building_range[1]);
+    if(building_range[2] ==-1)building_parameters[1] = randDNum(random, 100, 1000);else building_parameters[1] = randDNum(random, building_range[2], building_range[3]);
+    if(building_range[4] ==-1)building_parameters[2] = randDNum(random, 100, 1000);else building_parameters[2] = randDNum(random, building_range[4], building_range[5]);
+    if(building_range[6] ==-1)building_parameters[3] = randDNum(random, 100, 1000);else building_parameters[3] = randDNum(random, building_range[6], building_range[7]);
+    if(building_range[8] ==-1)building_parameters[4] = randDNum(random, 100, 1000);else building_parameters[4] = randDNum(random, building_range[8], building_range[9]);
     
     double overhang_parameters[3];//[width, thickness, height]
-    if(overhang_range[0]==-1)overhang_parameters[0] = randDNum(building_parameters[4]/30,building_parameters[4]/20); else overhang_parameters[0] = randDNum(overhang_range[0],overhang_range[1]);
-    if(overhang_range[2]==-1)overhang_parameters[1] = randDNum(building_parameters[4]/30,building_parameters[4]/20); else overhang_parameters[1] = randDNum(overhang_range[2], overhang_range[3]);
-    if(overhang_range[4]==-1)overhang_parameters[2] = randDNum(building_parameters[4]/30,building_parameters[4]/20); else overhang_parameters[2] = randDNum(overhang_range[4],overhang_range[5]);
+    if(overhang_range[0]==-1)overhang_parameters[0] = randDNum(random, building_parameters[4]/30,building_parameters[4]/20); else overhang_parameters[0] = randDNum(random, overhang_range[0],overhang_range[1]);
+    if(overhang_range[2]==-1)overhang_parameters[1] = randDNum(random, building_parameters[4]/30,building_parameters[4]/20); else overhang_parameters[1] = randDNum(random, overhang_range[2], overhang_range[3]);
+    if(overhang_range[4]==-1)overhang_parameters[2] = randDNum(random, building_parameters[4]/30,building_parameters[4]/20); else overhang_parameters[2] = randDNum(random, overhang_range[4],overhang_range[5]);
     
     double window_scale_parameters[6];//{bottom_width, bottom_height, center_width, center_height, top_width, top_height}
-    if(window_scale_range[0]==-1)window_scale_parameters[0] = randINum(1, 3); else window_scale_parameters[0] = randINum(window_scale_range[0], window_scale_range[1]);
-    if(window_scale_range[0]==-1)window_scale_parameters[1] = randINum(1, 2); else window_scale_parameters[1] = randINum(window_scale_range[2], window_scale_range[3]);
-    if(window_scale_range[0]==-1)window_scale_parameters[2] = randINum(1, 3); else window_scale_parameters[2] = randINum(window_scale_range[4], window_scale_range[5]);
-    if(window_scale_range[0]==-1)window_scale_parameters[3] = randINum(1, 2); else window_scale_parameters[3] = randINum(window_scale_range[6], window_scale_range[7]);
-    if(window_scale_range[0]==-1)window_scale_parameters[4] = randINum(1, 3); else window_scale_parameters[4] = randINum(window_scale_range[8], window_scale_range[9]);
-    if(window_scale_range[0]==-1)window_scale_parameters[5] = randINum(1, 2); else window_scale_parameters[5] = randINum(window_scale_range[10], window_scale_range[11]);
+    if(window_scale_range[0]==-1)window_scale_parameters[0] = randINum(random, 1, 3); else window_scale_parameters[0] = randINum(random, window_scale_range[0], window_scale_range[1]);
+    if(window_scale_range[0]==-1)window_scale_parameters[1] = randINum(random, 1, 2); else window_scale_parameters[1] = randINum(random, window_scale_range[2], window_scale_range[3]);
+    if(window_scale_range[0]==-1)window_scale_parameters[2] = randINum(random, 1, 3); else window_scale_parameters[2] = randINum(random, window_scale_range[4], window_scale_range[5]);
+    if(window_scale_range[0]==-1)window_scale_parameters[3] = randINum(random, 1, 2); else window_scale_parameters[3] = randINum(random, window_scale_range[6], window_scale_range[7]);
+    if(window_scale_range[0]==-1)window_scale_parameters[4] = randINum(random, 1, 3); else window_scale_parameters[4] = randINum(random, window_scale_range[8], window_scale_range[9]);
+    if(window_scale_range[0]==-1)window_scale_parameters[5] = randINum(random, 1, 2); else window_scale_parameters[5] = randINum(random, window_scale_range[10], window_scale_range[11]);
     
     double grid_top_parameters[8];//{width, length, side3, side4, side5, side6, height, style}
-    if(grid_top_range[0]==-1) grid_top_parameters[0] = randINum(building_parameters[1]/80,building_parameters[1]/50); else grid_top_parameters[0] = randINum(grid_top_range[0], grid_top_range[1]);
-    if(grid_top_range[2]==-1) grid_top_parameters[1] = randINum(building_parameters[0]/80,building_parameters[0]/50); else grid_top_parameters[1] = randINum(grid_top_range[2], grid_top_range[3]);
-    if(grid_top_range[4]==-1) grid_top_parameters[2] = randINum((building_parameters[1]+building_parameters[3])/80,(building_parameters[1]+building_parameters[3])/50); else grid_top_parameters[2] = randINum(grid_top_range[4], grid_top_range[5]);
-    if(grid_top_range[6]==-1) grid_top_parameters[3] = randINum(building_parameters[0]/80,building_parameters[0]/50); else grid_top_parameters[3] = randINum(grid_top_range[6], grid_top_range[7]);
-    if(grid_top_range[8]==-1) grid_top_parameters[4] = randINum(building_parameters[2]/80,building_parameters[2]/50); else grid_top_parameters[4] = randINum(grid_top_range[8], grid_top_range[9]);
-    if(grid_top_range[10]==-1)grid_top_parameters[5] = randINum(building_parameters[1]/80,building_parameters[1]/50); else grid_top_parameters[5] = randINum(grid_top_range[10], grid_top_range[11]);
-    if(grid_top_range[12]==-1)grid_top_parameters[6] = randINum(grid_top_parameters[0]/2,grid_top_parameters[0]*2); else grid_top_parameters[6] = randINum(grid_top_range[12], grid_top_range[13]);
+    if(grid_top_range[0]==-1) grid_top_parameters[0] = randINum(random, building_parameters[1]/80,building_parameters[1]/50); else grid_top_parameters[0] = randINum(random, grid_top_range[0], grid_top_range[1]);
+    if(grid_top_range[2]==-1) grid_top_parameters[1] = randINum(random, building_parameters[0]/80,building_parameters[0]/50); else grid_top_parameters[1] = randINum(random, grid_top_range[2], grid_top_range[3]);
+    if(grid_top_range[4]==-1) grid_top_parameters[2] = randINum(random, (building_parameters[1]+building_parameters[3])/80,(building_parameters[1]+building_parameters[3])/50); else grid_top_parameters[2] = randINum(random, grid_top_range[4], grid_top_range[5]);
+    if(grid_top_range[6]==-1) grid_top_parameters[3] = randINum(random, building_parameters[0]/80,building_parameters[0]/50); else grid_top_parameters[3] = randINum(random, grid_top_range[6], grid_top_range[7]);
+    if(grid_top_range[8]==-1) grid_top_parameters[4] = randINum(random, building_parameters[2]/80,building_parameters[2]/50); else grid_top_parameters[4] = randINum(random, grid_top_range[8], grid_top_range[9]);
+    if(grid_top_range[10]==-1)grid_top_parameters[5] = randINum(random, building_parameters[1]/80,building_parameters[1]/50); else grid_top_parameters[5] = randINum(random, grid_top_range[10], grid_top_range[11]);
+    if(grid_top_range[12]==-1)grid_top_parameters[6] = randINum(random, grid_top_parameters[0]/2,grid_top_parameters[0]*2); else grid_top_parameters[6] = randINum(random, grid_top_range[12], grid_top_range[13]);
     grid_top_parameters[7] = 1;
     
     double grid_center_parameters[8];//{width, length, side3, side4, side5, side6, height, style}
-    if(grid_center_range[0]==-1)grid_center_parameters[0] = randINum(building_parameters[1]/80,building_parameters[1]/50); else grid_center_parameters[0] = randINum(grid_center_range[0], grid_center_range[1]);
-    if(grid_center_range[2]==-1)grid_center_parameters[1] = randINum(building_parameters[0]/80,building_parameters[0]/50); else grid_center_parameters[1] = randINum(grid_center_range[2], grid_center_range[3]);
-    if(grid_center_range[4]==-1)grid_center_parameters[2] = randINum((building_parameters[1]+building_parameters[3])/80,(building_parameters[1]+building_parameters[3])/50); else grid_center_parameters[2] = randINum(grid_center_range[4], grid_center_range[5]);
-    if(grid_center_range[6]==-1)grid_center_parameters[3] = randINum(building_parameters[0]/80,building_parameters[0]/50); else grid_center_parameters[3] = randINum(grid_center_range[6], grid_center_range[7]);
-    if(grid_center_range[8]==-1)grid_center_parameters[4] = randINum(building_parameters[2]/80,building_parameters[2]/50); else grid_center_parameters[4] = randINum(grid_center_range[8], grid_center_range[9]);
-    if(grid_center_range[10]==-1)grid_center_parameters[5] = randINum(building_parameters[1]/80,building_parameters[1]/50); else grid_center_parameters[5] = randINum(grid_center_range[10], grid_center_range[11]);
-    if(grid_center_range[12]==-1)grid_center_parameters[6] = randINum(grid_top_parameters[0]/2,grid_top_parameters[0]*2); else grid_center_parameters[6] = randINum(grid_center_range[12], grid_center_range[13]);
+    if(grid_center_range[0]==-1)grid_center_parameters[0] = randINum(random, building_parameters[1]/80,building_parameters[1]/50); else grid_center_parameters[0] = randINum(random, grid_center_range[0], grid_center_range[1]);
+    if(grid_center_range[2]==-1)grid_center_parameters[1] = randINum(random, building_parameters[0]/80,building_parameters[0]/50); else grid_center_parameters[1] = randINum(random, grid_center_range[2], grid_center_range[3]);
+    if(grid_center_range[4]==-1)grid_center_parameters[2] = randINum(random, (building_parameters[1]+building_parameters[3])/80,(building_parameters[1]+building_parameters[3])/50); else grid_center_parameters[2] = randINum(random, grid_center_range[4], grid_center_range[5]);
+    if(grid_center_range[6]==-1)grid_center_parameters[3] = randINum(random, building_parameters[0]/80,building_parameters[0]/50); else grid_center_parameters[3] = randINum(random, grid_center_range[6], grid_center_range[7]);
+    if(grid_center_range[8]==-1)grid_center_parameters[4] = randINum(random, building_parameters[2]/80,building_parameters[2]/50); else grid_center_parameters[4] = randINum(random, grid_center_range[8], grid_center_range[9]);
+    if(grid_center_range[10]==-1)grid_center_parameters[5] = randINum(random, building_parameters[1]/80,building_parameters[1]/50); else grid_center_parameters[5] = randINum(random, grid_center_range[10], grid_center_range[11]);
+    if(grid_center_range[12]==-1)grid_center_parameters[6] = randINum(random, grid_top_parameters[0]/2,grid_top_parameters[0]*2); else grid_center_parameters[6] = randINum(random, grid_center_range[12], grid_center_range[13]);
     grid_center_parameters[7] = 1;
     
     double grid_bottom_parameters[8];//{width, length, side3, side4, side5, side6, height, style}
-    if(grid_bottom_range[0]==-1)grid_bottom_parameters[0] = randINum(building_parameters[1]/80,building_parameters[1]/50); else grid_bottom_parameters[0] = randINum(grid_bottom_range[0], grid_bottom_range[1]);
-    if(grid_bottom_range[2]==-1)grid_bottom_parameters[1] = randINum(building_parameters[0]/80,building_parameters[0]/50); else grid_bottom_parameters[1] = randINum(grid_bottom_range[2], grid_bottom_range[3]);
-    if(grid_bottom_range[4]==-1)grid_bottom_parameters[2] = randINum((building_parameters[1]+building_parameters[3])/80,(building_parameters[1]+building_parameters[3])/50); else grid_bottom_parameters[2] = randINum(grid_bottom_range[4], grid_bottom_range[5]);
-    if(grid_bottom_range[6]==-1)grid_bottom_parameters[3] = randINum(building_parameters[0]/80,building_parameters[0]/50); else grid_bottom_parameters[3] = randINum(grid_bottom_range[6], grid_bottom_range[7]);
-    if(grid_bottom_range[8]==-1)grid_bottom_parameters[4] = randINum(building_parameters[2]/80,building_parameters[2]/50); else grid_bottom_parameters[4] = randINum(grid_bottom_range[8], grid_bottom_range[9]);
-    if(grid_bottom_range[10]==-1)grid_bottom_parameters[5] = randINum(building_parameters[1]/80,building_parameters[1]/50); else grid_bottom_parameters[5] = randINum(grid_bottom_range[10], grid_bottom_range[11]);
-    if(grid_bottom_range[12]==-1)grid_bottom_parameters[6] = randDNum(building_parameters[4]/grid_top_parameters[6],building_parameters[4]/10); else grid_bottom_parameters[6] = randDNum(grid_bottom_range[12], grid_bottom_range[13]);
+    if(grid_bottom_range[0]==-1)grid_bottom_parameters[0] = randINum(random, building_parameters[1]/80,building_parameters[1]/50); else grid_bottom_parameters[0] = randINum(random, grid_bottom_range[0], grid_bottom_range[1]);
+    if(grid_bottom_range[2]==-1)grid_bottom_parameters[1] = randINum(random, building_parameters[0]/80,building_parameters[0]/50); else grid_bottom_parameters[1] = randINum(random, grid_bottom_range[2], grid_bottom_range[3]);
+    if(grid_bottom_range[4]==-1)grid_bottom_parameters[2] = randINum(random, (building_parameters[1]+building_parameters[3])/80,(building_parameters[1]+building_parameters[3])/50); else grid_bottom_parameters[2] = randINum(random, grid_bottom_range[4], grid_bottom_range[5]);
+    if(grid_bottom_range[6]==-1)grid_bottom_parameters[3] = randINum(random, building_parameters[0]/80,building_parameters[0]/50); else grid_bottom_parameters[3] = randINum(random, grid_bottom_range[6], grid_bottom_range[7]);
+    if(grid_bottom_range[8]==-1)grid_bottom_parameters[4] = randINum(random, building_parameters[2]/80,building_parameters[2]/50); else grid_bottom_parameters[4] = randINum(random, grid_bottom_range[8], grid_bottom_range[9]);
+    if(grid_bottom_range[10]==-1)grid_bottom_parameters[5] = randINum(random, building_parameters[1]/80,building_parameters[1]/50); else grid_bottom_parameters[5] = randINum(random, grid_bottom_range[10], grid_bottom_range[11]);
+    if(grid_bottom_range[12]==-1)grid_bottom_parameters[6] = randDNum(random, building_parameters[4]/grid_top_parameters[6],building_parameters[4]/10); else grid_bottom_parameters[6] = randDNum(random, grid_bottom_range[12], grid_bottom_range[13]);
     grid_bottom_parameters[7] = 1;
     
     double window_design_parameters[3];//{bottom, center, top}
-    if(window_design_range[0]==-1)window_design_parameters[0] = randINum(1, 5); else window_design_parameters[0] = randINum(window_design_range[0], window_design_range[1]);
-    if(window_design_range[2]==-1)window_design_parameters[1] = randINum(1, 5); else window_design_parameters[1] = randINum(window_design_range[2], window_design_range[3]);
-    if(window_design_range[4]==-1)window_design_parameters[2] = randINum(1, 5); else window_design_parameters[2] = randINum(window_design_range[4], window_design_range[5]);
+    if(window_design_range[0]==-1)window_design_parameters[0] = randINum(random, 1, 5); else window_design_parameters[0] = randINum(random, window_design_range[0], window_design_range[1]);
+    if(window_design_range[2]==-1)window_design_parameters[1] = randINum(random, 1, 5); else window_design_parameters[1] = randINum(random, window_design_range[2], window_design_range[3]);
+    if(window_design_range[4]==-1)window_design_parameters[2] = randINum(random, 1, 5); else window_design_parameters[2] = randINum(random, window_design_range[4], window_design_range[5]);
     
     double door_parameters[3]; //{position, width_scale, height_scale}
-    if(door_range[0] ==-1) door_parameters[0]=1;else door_parameters[0] = randDNum(door_range[0], door_range[1]);
-    if(door_range[2] ==-1)door_parameters[1] =2;else door_parameters[1] = randDNum(door_range[2], door_range[3]);
-    if(door_range[4] ==-1)door_parameters[2] =2;else door_parameters[2] = randDNum(door_range[4], door_range[5]);
+    if(door_range[0] ==-1) door_parameters[0]=1;else door_parameters[0] = randDNum(random, door_range[0], door_range[1]);
+    if(door_range[2] ==-1)door_parameters[1] =2;else door_parameters[1] = randDNum(random, door_range[2], door_range[3]);
+    if(door_range[4] ==-1)door_parameters[2] =2;else door_parameters[2] = randDNum(random, door_range[4], door_range[5]);
     
     std::vector <std::vector <int> > railing_parameters;
     std::vector<std::vector <int> > remove_windows;
     
     double vertical_offset =-(grid_bottom_parameters[6]/2);
     
-    Nef_polyhedron nef;
-    
     //The below segment reads the input file. If a number is found, it will replace the number
     //generated above with the inputed number.
     
@@ -1235,176 +4168,176 @@ Nef_polyhedron parameter_management(int num, std::string input_file){
                 //Each of the many if statements first check if the number is a range or not, and
                 //handles it depending on that.
                 if (!data.compare("Shape Type")){
-                    if(line.find(",") != std::string::npos)shape_type=randINum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)shape_type=randINum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else shape_type=atof(numbers.c_str());
                 }
                 else if (!data.compare("Sides")){
-                    if(line.find(",") != std::string::npos)sides=randINum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)sides=randINum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else sides=atof(numbers.c_str());
                 }
                 else if (!data.compare("Building Width 1")){
-                    if(line.find(",") != std::string::npos)building_parameters[0]=randDNum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)building_parameters[0]=randDNum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else building_parameters[0]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Building Length 1")){
-                    if(line.find(",") != std::string::npos)building_parameters[1]=randDNum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)building_parameters[1]=randDNum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else building_parameters[1]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Building Width 2")){
-                    if(line.find(",") != std::string::npos)building_parameters[2]=randDNum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)building_parameters[2]=randDNum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else building_parameters[2]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Building Length 2")){
-                    if(line.find(",") != std::string::npos)building_parameters[3]=randDNum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)building_parameters[3]=randDNum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else building_parameters[3]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Building Height")){
-                    if(line.find(",") != std::string::npos)building_parameters[4]=randDNum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)building_parameters[4]=randDNum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else building_parameters[4]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Overhang Width")){
-                    if(line.find(",") != std::string::npos)overhang_parameters[0]=randDNum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)overhang_parameters[0]=randDNum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else overhang_parameters[0]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Overhang Thickness")){
-                    if(line.find(",") != std::string::npos)overhang_parameters[1]=randDNum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)overhang_parameters[1]=randDNum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else overhang_parameters[1]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Overhang Height")){
-                    if(line.find(",") != std::string::npos)overhang_parameters[2]=randDNum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)overhang_parameters[2]=randDNum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else overhang_parameters[2]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Window Bottom Width Scale")){
-                    if(line.find(",") != std::string::npos)window_scale_parameters[0]=randDNum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)window_scale_parameters[0]=randDNum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else window_scale_parameters[0]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Window Bottom Height Scale")){
-                    if(line.find(",") != std::string::npos)window_scale_parameters[1]=randDNum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)window_scale_parameters[1]=randDNum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else window_scale_parameters[1]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Window Centre Width Scale")){
-                    if(line.find(",") != std::string::npos)window_scale_parameters[2]=randDNum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)window_scale_parameters[2]=randDNum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else window_scale_parameters[2]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Window Centre Height Scale")){
-                    if(line.find(",") != std::string::npos)window_scale_parameters[3]=randDNum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)window_scale_parameters[3]=randDNum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else window_scale_parameters[3]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Window Top Width Scale")){
-                    if(line.find(",") != std::string::npos)window_scale_parameters[4]=randDNum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)window_scale_parameters[4]=randDNum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else window_scale_parameters[4]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Window Top Height Scale")){
-                    if(line.find(",") != std::string::npos)window_scale_parameters[5]=randDNum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)window_scale_parameters[5]=randDNum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else window_scale_parameters[5]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Grid Bottom Width")){
-                    if(line.find(",") != std::string::npos)grid_bottom_parameters[0]=randINum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)grid_bottom_parameters[0]=randINum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else grid_bottom_parameters[0]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Grid Bottom Length")){
-                    if(line.find(",") != std::string::npos)grid_bottom_parameters[1]=randINum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)grid_bottom_parameters[1]=randINum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else grid_bottom_parameters[1]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Grid Bottom Side 3")){
-                    if(line.find(",") != std::string::npos)grid_bottom_parameters[2]=randINum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)grid_bottom_parameters[2]=randINum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else grid_bottom_parameters[2]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Grid Bottom Side 4")){
-                    if(line.find(",") != std::string::npos)grid_bottom_parameters[3]=randINum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)grid_bottom_parameters[3]=randINum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else grid_bottom_parameters[3]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Grid Bottom Side 5")){
-                    if(line.find(",") != std::string::npos)grid_bottom_parameters[4]=randINum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)grid_bottom_parameters[4]=randINum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else grid_bottom_parameters[4]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Grid Bottom Side 6")){
-                    if(line.find(",") != std::string::npos)grid_bottom_parameters[5]=randINum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)grid_bottom_parameters[5]=randINum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else grid_bottom_parameters[5]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Bottom Tile Height")){
-                    if(line.find(",") != std::string::npos)grid_bottom_parameters[6]=randDNum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)grid_bottom_parameters[6]=randDNum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else grid_bottom_parameters[6]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Grid Centre Width")){
-                    if(line.find(",") != std::string::npos)grid_center_parameters[0]=randINum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)grid_center_parameters[0]=randINum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else grid_center_parameters[0]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Grid Centre Length")){
-                    if(line.find(",") != std::string::npos)grid_center_parameters[1]=randINum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)grid_center_parameters[1]=randINum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else grid_center_parameters[1]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Grid Centre Side 3")){
-                    if(line.find(",") != std::string::npos)grid_center_parameters[2]=randINum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)grid_center_parameters[2]=randINum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else grid_center_parameters[2]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Grid Centre Side 4")){
-                    if(line.find(",") != std::string::npos)grid_center_parameters[3]=randINum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)grid_center_parameters[3]=randINum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else grid_center_parameters[3]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Grid Centre Side 5")){
-                    if(line.find(",") != std::string::npos)grid_center_parameters[4]=randINum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)grid_center_parameters[4]=randINum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else grid_center_parameters[4]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Grid Centre Side 6")){
-                    if(line.find(",") != std::string::npos)grid_center_parameters[5]=randINum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)grid_center_parameters[5]=randINum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else grid_center_parameters[5]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Grid Top Width")){
-                    if(line.find(",") != std::string::npos)grid_top_parameters[0]=randINum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)grid_top_parameters[0]=randINum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else grid_top_parameters[0]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Grid Top Length")){
-                    if(line.find(",") != std::string::npos)grid_top_parameters[1]=randINum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)grid_top_parameters[1]=randINum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else grid_top_parameters[1]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Grid Top Side 3")){
-                    if(line.find(",") != std::string::npos)grid_top_parameters[2]=randINum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)grid_top_parameters[2]=randINum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else grid_top_parameters[2]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Grid Top Side 4")){
-                    if(line.find(",") != std::string::npos)grid_top_parameters[3]=randINum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)grid_top_parameters[3]=randINum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else grid_top_parameters[3]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Grid Top Side 5")){
-                    if(line.find(",") != std::string::npos)grid_top_parameters[4]=randINum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)grid_top_parameters[4]=randINum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else grid_top_parameters[4]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Grid Top Side 6")){
-                    if(line.find(",") != std::string::npos)grid_top_parameters[5]=randINum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)grid_top_parameters[5]=randINum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else grid_top_parameters[5]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Grid Height")){
-                    if(line.find(",") != std::string::npos)grid_top_parameters[6]=randINum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)grid_top_parameters[6]=randINum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else grid_top_parameters[6]=atof(numbers.c_str());
                 }
                 
                 else if (!data.compare("Vertical Offset")){
-                    if(line.find(",") != std::string::npos)vertical_offset=randINum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)vertical_offset=randINum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else vertical_offset=atof(numbers.c_str());
                 }
                 else if (!data.compare("Window Bottom Design")){
-                    if(line.find(",") != std::string::npos)window_design_parameters[0]=randINum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)window_design_parameters[0]=randINum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else window_design_parameters[0]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Window Centre Design")){
-                    if(line.find(",") != std::string::npos)window_design_parameters[1]=randINum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)window_design_parameters[1]=randINum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else window_design_parameters[1]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Window Top Design")){
-                    if(line.find(",") != std::string::npos)window_design_parameters[2]=randINum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)window_design_parameters[2]=randINum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else window_design_parameters[2]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Door Location")){
-                    if(line.find(",") != std::string::npos)door_parameters[0]=randINum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)door_parameters[0]=randINum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else door_parameters[0]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Door Width Scale")){
-                    if(line.find(",") != std::string::npos)door_parameters[1]=randDNum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)door_parameters[1]=randDNum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else door_parameters[1]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Door Height Scale")){
-                    if(line.find(",") != std::string::npos)door_parameters[2]=randDNum(atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
+                    if(line.find(",") != std::string::npos)door_parameters[2]=randDNum(random, atof(numbers.substr(0, numbers.find(",", 0)).c_str()), atof(numbers.substr(numbers.find(",") + 1).c_str()));
                     else door_parameters[2]=atof(numbers.c_str());
                 }
                 else if (!data.compare("Remove Window")){
@@ -1462,7 +4395,7 @@ Nef_polyhedron parameter_management(int num, std::string input_file){
         myfile.close();
     }
     
-    else std::cout << "Unable to open file";
+    else Log_line(LOG_SUMMARY) << "Unable to open file: " << input_file;
     
     //Due to the 2nd shape type being a polygon of n sides, all the sides in the grid parameters
     //need to be set to the first one.
@@ -1475,32 +4408,711 @@ Nef_polyhedron parameter_management(int num, std::string input_file){
     }
     
     
-    output_paramaters_txt(remove_windows, sides, shape_type, building_parameters, railing_parameters, grid_bottom_parameters,grid_center_parameters, grid_top_parameters, window_scale_parameters, window_design_parameters, door_parameters, vertical_offset, overhang_parameters, num);
-    nef += grammar(remove_windows, sides, shape_type, building_parameters, railing_parameters, grid_bottom_parameters,grid_center_parameters, grid_top_parameters, window_scale_parameters, window_design_parameters, door_parameters, vertical_offset, overhang_parameters, num);
+    //If only the estimate is wanted, nothing is generated (or written). Otherwise a building estimated
+    //over the triangle budget is skipped, and no levels are returned.
+    Cost_estimate cost = estimate_cost(remove_windows, sides, shape_type, building_parameters, railing_parameters, grid_bottom_parameters, grid_center_parameters, grid_top_parameters, window_scale_parameters, window_design_parameters, door_parameters);
+    if(estimate){
+        *estimate = cost;
+        return std::vector<Assembly<Solid> >();
+    }
+    if(triangle_budget>0 && cost.triangles>triangle_budget){
+        Log_line(LOG_SUMMARY) << "Building " << num << ": skipped, estimated " << cost.triangles << " triangles is over the budget of " << triangle_budget;
+        return std::vector<Assembly<Solid> >();
+    }
+    Log_line(LOG_VERBOSE) << "Building " << num << ": estimated " << cost.booleans << " Booleans, " << cost.triangles << " triangles, " << cost.seconds << " seconds";
+    
+    output_paramaters_txt(remove_windows, sides, shape_type, building_parameters, railing_parameters, grid_bottom_parameters,grid_center_parameters, grid_top_parameters, window_scale_parameters, window_design_parameters, door_parameters, vertical_offset, overhang_parameters, num, seed);
+    
+    //With the mesh cache, a building with the same resolved parameters as one generated before is
+    //linked from the cache instead, and no levels are returned.
+    if(cache && !mesh_cache_dir.empty()){
+        cache->key = building_key(remove_windows, sides, shape_type, building_parameters, railing_parameters, grid_bottom_parameters, grid_center_parameters, grid_top_parameters, window_scale_parameters, window_design_parameters, door_parameters, vertical_offset, overhang_parameters);
+        cache->file_name = building_file_name(shape_type, num);
+        if(restore_cached_mesh(cache->key, cache->file_name)){
+            cache->hit = true;
+            file_name = mesh_file_names(cache->file_name).back();
+            profile_count("mesh cache hits", 1);
+            Log_line(LOG_SUMMARY) << "Building " << num << ": taken from the mesh cache (" << key_hash(cache->key) << ")";
+            return std::vector<Assembly<Solid> >();
+        }
+        profile_count("mesh cache misses", 1);
+    }
+    return grammar<Solid>(remove_windows, sides, shape_type, building_parameters, railing_parameters, grid_bottom_parameters,grid_center_parameters, grid_top_parameters, window_scale_parameters, window_design_parameters, door_parameters, vertical_offset, overhang_parameters, num, file_name, counts);
+}
+//This returns the seed given in the input file ("Seed = N"), or the seed passed in if there isn't one.
+unsigned long long read_seed(std::string input_file, unsigned long long seed){
+    std::ifstream myfile (input_file);
+    std::string line;
+    while(getline(myfile, line)){
+        if(!line.substr(0, line.find(" = ", 0)).compare("Seed"))
+            seed = strtoull(line.substr(line.find("= ") + 1).c_str(), NULL, 10);
+    }
+    return seed;
+}
+
+//This writes the levels of detail of a building, each to its own file (with _lod<N> before the
+//extension) if there are several. The file name is set to the full detail file. With --stream, the
+//levels were already written by the grammar.
+template<class Solid>
+void write_levels(const std::vector<Assembly<Solid> >& levels, std::string& file_name){
+    if(stream_output) return;
+    std::string base_name = file_name;
+    for(std::size_t i = 0; i<levels.size(); i++){
+        file_name = level_file_name(base_name, i, levels.size());
+        write_assembly(levels[i], file_name);
+    }
+}
+
+//This function generates a single building from the input file and writes its mesh (and output
+//parameters) numbered by num. The random parameters are drawn from the given seed, unless the
+//input file has its own. It returns the name of the mesh file, which is empty if the building was
+//skipped (over the triangle budget). With --mesh-cache, a generated mesh is stored in the cache.
+std::string generate_building(int num, std::string input_file, unsigned long long seed){
+    Stage_timer timer("building");
+    std::string file_name;
+    seed = read_seed(input_file, seed);
+    Random random(seed);
+    Tile_counts counts;
+    Mesh_cache_entry cache;
+    
+    //The fast backend builds the same building on doubles, and is written the same way.
+    if(fast_backend)
+        write_levels(parameter_management<Fast_solid>(num, input_file, file_name, random, seed, counts, NULL, &cache), file_name);
+    //The CSG tree is optimized and evaluated when it is written.
+    else if(csg)
+        write_levels(parameter_management<Csg_solid>(num, input_file, file_name, random, seed, counts, NULL, &cache), file_name);
+    else if(eager_transforms){
+        std::vector<Nef_assembly> levels = parameter_management<Nef_polyhedron>(num, input_file, file_name, random, seed, counts, NULL, &cache);
+        if(!levels.empty()){
+            profile_count("nef vertices", levels.back().nef.number_of_vertices());
+            profile_count("nef facets", levels.back().nef.number_of_facets());
+        }
+        write_levels(levels, file_name);
+    }
+    //By default, the exact backend only applies the transformations when they are needed.
+    else{
+        std::vector<Assembly<Lazy_nef> > levels = parameter_management<Lazy_nef>(num, input_file, file_name, random, seed, counts, NULL, &cache);
+        for(std::size_t i = 0; i<levels.size(); i++)
+            levels[i].nef.apply();
+        if(!levels.empty()){
+            profile_count("nef vertices", levels.back().nef.nef.number_of_vertices());
+            profile_count("nef facets", levels.back().nef.nef.number_of_facets());
+        }
+        write_levels(levels, file_name);
+    }
+    if(file_name.empty()){
+        flush_log();
+        return file_name;
+    }
+    if(!cache.hit){
+        if(!cache.key.empty()) store_cached_mesh(cache.key, cache.file_name);
+        Log_line(LOG_SUMMARY) << "Building " << num << ": " << counts.windows << " windows, " << counts.removed << " removed windows, " << counts.railings << " railings, " << counts.doors << " doors";
+    }
+    Log_line(LOG_SUMMARY) << "Saved file as: " << file_name << " (seed " << seed << ")";
+    flush_log();
+    return file_name;
+}
+
+//This estimates the cost of a building from its input file, without generating it. The parameters
+//are drawn the same way as by generate_building, so the estimate is for the same building.
+Cost_estimate estimate_building(int num, std::string input_file, unsigned long long seed){
+    std::string file_name;
+    seed = read_seed(input_file, seed);
+    Random random(seed);
+    Tile_counts counts;
+    Cost_estimate estimate;
+    parameter_management<Fast_solid>(num, input_file, file_name, random, seed, counts, &estimate);
+    return estimate;
+}
+
+//This reads the list of parameter files used in batch mode, one file per line.
+std::vector<std::string> read_batch_list(std::string list_file){
+    std::vector<std::string> input_files;
+    if(list_file.empty()) return input_files;
+    
+    std::string line;
+    std::ifstream myfile (list_file);
+    if (myfile.is_open()){
+        while ( getline (myfile,line) ){
+            if(!line.empty() && line.substr(0, 2).compare("//")) input_files.push_back(line);
+        }
+        myfile.close();
+    }
+    else std::cout << "Unable to open file";
+    
+    return input_files;
+}
+
+//------------------------------SERVER--------------------------
+
+//With --serve, the program starts once and keeps generating buildings for requests, so the cube and
+//cylinder templates and the prototype caches stay warm between them. The requests are read one per line
+//from stdin, or from each client of a Unix socket with --socket PATH:
+//  generate FILE [SEED] [inline]   generates a building from the parameter file.
+//  params [SEED] [inline]          generates a building from the parameter lines which follow, up to "end".
+//  stats                           replies with the amount of requests and the latency of the last 1000.
+//  quit                            stops reading requests from stdin (or this client).
+//  shutdown                        also stops the socket server once its requests are done.
+//The requests are numbered from 1 (which is the num of their files), and each one runs as its own task,
+//so several are generated at once. Each is answered once it is done with "ok ID FILE SECONDS" (followed
+//by "mesh BYTES" and the bytes of the mesh file with inline) or "error ID MESSAGE". Without a SEED, the
+//request uses the seed of the run plus its ID-1, like batch mode. The server's memory doesn't grow with
+//the amount of requests: the prototype cache is bounded (--prototype-cache-size), and the stats only
+//keep the latency of the last requests.
+
+std::mutex server_lock;
+const std::size_t server_latency_window = 1000; //The amount of requests kept for the latency stats.
+std::vector<double> server_latencies; //The seconds taken by the last requests, as a ring buffer.
+std::size_t server_latency_count = 0; //The amount of requests timed since the start.
+std::atomic<int> server_requests(0);
+std::atomic<bool> server_stopping(false);
+//The replies on stdin are written to the real stdout, as everything else printed is sent to stderr then.
+std::ostream server_output(std::cout.rdbuf());
+
+//A Server_connection reads the requests of stdin (if fd is -1) or a socket client, and writes the replies.
+//Each reply is written in one go, so the replies of concurrent requests don't interleave.
+class Server_connection{
+public:
+    explicit Server_connection(int fd) : fd(fd){}
+    
+    bool read_line(std::string& line){
+        if(fd<0) return static_cast<bool>(std::getline(std::cin, line));
+#if defined(__unix__) || defined(__APPLE__)
+        std::size_t end;
+        while((end = received.find('\n'))==std::string::npos){
+            char buffer[4096];
+            ssize_t size = recv(fd, buffer, sizeof(buffer), 0);
+            if(size<=0){
+                if(received.empty()) return false;
+                end = received.size();
+                received+='\n';
+                break;
+            }
+            received.append(buffer, size);
+        }
+        line = received.substr(0, end);
+        received.erase(0, end+1);
+        if(!line.empty() && line[line.size()-1]=='\r') line.erase(line.size()-1);
+        return true;
+#else
+        return false;
+#endif
+    }
     
-    return nef;
+    void reply(const std::string& text){
+        std::lock_guard<std::mutex> guard(lock);
+        if(fd<0){
+            server_output << text << std::flush;
+            return;
+        }
+#if defined(__unix__) || defined(__APPLE__)
+        std::size_t sent = 0;
+        while(sent<text.size()){
+            ssize_t size = send(fd, text.data()+sent, text.size()-sent, 0);
+            if(size<=0) return;
+            sent+=size;
+        }
+#endif
+    }
+    
+private:
+    int fd;
+    std::mutex lock;
+    std::string received;
+};
+
+//This returns the stats reply: the amount of requests, and the mean, median, 95th percentile and
+//maximum latency in milliseconds of the last server_latency_window of them.
+std::string server_stats(){
+    std::lock_guard<std::mutex> guard(server_lock);
+    std::vector<double> latencies = server_latencies;
+    std::sort(latencies.begin(), latencies.end());
+    
+    double total = 0;
+    for(std::size_t i = 0; i<latencies.size(); i++) total+=latencies[i];
+    std::ostringstream stats;
+    stats << "stats requests " << server_latency_count;
+    if(!latencies.empty())
+        stats << " mean_ms " << total/latencies.size()*1000 << " p50_ms " << latencies[latencies.size()/2]*1000
+              << " p95_ms " << latencies[std::min(latencies.size()-1, latencies.size()*95/100)]*1000 << " max_ms " << latencies.back()*1000;
+    return stats.str()+"\n";
+}
+
+//This generates the building of a request and replies with its file (and the mesh itself if inline).
+void serve_request(Server_connection& connection, int id, std::string input_file, unsigned long long seed, bool inline_mesh){
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    try{
+        std::string file_name = generate_building(id, input_file, seed);
+        if(file_name.empty()){
+            connection.reply("error "+std::to_string(id)+" over the triangle budget\n");
+            return;
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+        {
+            std::lock_guard<std::mutex> guard(server_lock);
+            if(server_latencies.size()<server_latency_window) server_latencies.push_back(seconds);
+            else server_latencies[server_latency_count%server_latency_window] = seconds;
+            server_latency_count++;
+        }
+        
+        std::ostringstream reply;
+        reply << "ok " << id << " " << file_name << " " << seconds << "\n";
+        if(inline_mesh){
+            std::ifstream mesh(file_name, std::ios::binary);
+            std::string bytes((std::istreambuf_iterator<char>(mesh)), std::istreambuf_iterator<char>());
+            reply << "mesh " << bytes.size() << "\n" << bytes;
+        }
+        connection.reply(reply.str());
+    }
+    catch(std::exception& e){
+        connection.reply("error "+std::to_string(id)+" "+e.what()+"\n");
+    }
+}
+
+//This reads the requests of a connection until it ends, running each as a task, and waits for them.
+void serve_connection(Server_connection& connection, unsigned long long seed){
+    Task_group group(task_pool);
+    std::string line;
+    while(!server_stopping && connection.read_line(line)){
+        std::istringstream words(line);
+        std::string command;
+        words >> command;
+        
+        if(command.empty()) continue;
+        if(!command.compare("quit")) break;
+        if(!command.compare("shutdown")){
+            server_stopping = true;
+            break;
+        }
+        if(!command.compare("stats")){
+            connection.reply(server_stats());
+            continue;
+        }
+        if(command.compare("generate") && command.compare("params")){
+            connection.reply("error 0 unknown request: "+command+"\n");
+            continue;
+        }
+        
+        int id = ++server_requests;
+        std::string input_file;
+        if(!command.compare("generate")){
+            words >> input_file;
+            if(!std::ifstream(input_file).is_open()){
+                connection.reply("error "+std::to_string(id)+" cannot open "+input_file+"\n");
+                continue;
+            }
+        }
+        
+        unsigned long long request_seed = seed+id-1;
+        bool inline_mesh = false;
+        std::string word;
+        while(words >> word){
+            if(!word.compare("inline")) inline_mesh = true;
+            else request_seed = strtoull(word.c_str(), NULL, 10);
+        }
+        
+        //The parameter lines of the request are saved as its own parameter file, which is removed once
+        //the request is done.
+        bool temporary = !command.compare("params");
+        if(temporary){
+            input_file = "server_parameters_"+std::to_string(id)+".txt";
+            std::ofstream parameters(input_file);
+            while(connection.read_line(line) && line.compare("end"))
+                parameters << line << "\n";
+        }
+        
+        group.run([&connection, id, input_file, request_seed, inline_mesh, temporary](){
+            serve_request(connection, id, input_file, request_seed, inline_mesh);
+            if(temporary) std::remove(input_file.c_str());
+        });
+    }
+    group.wait();
+}
+
+//This runs the server on stdin, or on the Unix socket at socket_path, where each client is served by
+//its own thread until a client asks for a shutdown.
+void serve(std::string socket_path, unsigned long long seed){
+    if(socket_path.empty()){
+        Server_connection connection(-1);
+        serve_connection(connection, seed);
+        return;
+    }
+    
+#if defined(__unix__) || defined(__APPLE__)
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path)-1);
+    unlink(socket_path.c_str());
+    if(server<0 || bind(server, reinterpret_cast<sockaddr*>(&address), sizeof(address))<0 || listen(server, 16)<0){
+        std::cout << "Unable to open socket: " << socket_path << std::endl;
+        if(server>=0) close(server);
+        return;
+    }
+    Log_line(LOG_SUMMARY) << "Serving on " << socket_path;
+    flush_log();
+    
+    //Each client thread closes its own socket once its requests are done (so the client sees the end of
+    //the connection), and is detached. The sockets still open are kept so they can be stopped at shutdown.
+    std::mutex clients_lock;
+    std::condition_variable clients_done;
+    std::set<int> client_sockets;
+    while(!server_stopping){
+        int client = accept(server, NULL, NULL);
+        if(client<0) break;
+        {
+            std::lock_guard<std::mutex> guard(clients_lock);
+            client_sockets.insert(client);
+        }
+        std::thread([&, client, seed, server](){
+            Server_connection connection(client);
+            serve_connection(connection, seed);
+            //Wakes up the accept above, so the server stops.
+            if(server_stopping) shutdown(server, SHUT_RDWR);
+            
+            std::lock_guard<std::mutex> guard(clients_lock);
+            client_sockets.erase(client);
+            shutdown(client, SHUT_RDWR);
+            close(client);
+            clients_done.notify_all();
+        }).detach();
+    }
+    
+    //The other clients stop reading requests, but still get the replies of the ones they sent.
+    std::unique_lock<std::mutex> guard(clients_lock);
+    for(std::set<int>::iterator it = client_sockets.begin(); it!=client_sockets.end(); ++it)
+        shutdown(*it, SHUT_RD);
+    clients_done.wait(guard, [&](){ return client_sockets.empty(); });
+    guard.unlock();
+    close(server);
+    unlink(socket_path.c_str());
+#else
+    std::cout << "Unix sockets aren't supported on this platform, use stdin instead" << std::endl;
+#endif
+}
+
+//------------------------------BENCHMARK--------------------------
+
+//The benchmark executable (built by CMake from this file with BUILDING_BENCHMARK defined) generates a
+//fixed set of buildings: every shape type, grid sizes from 2x2 up to 10x30 and every window design.
+//Each case writes its parameters to a file and generates it like the normal program, with a fixed seed
+//and cold prototype caches. The results (wall time, time/Booleans of each stage, output triangles and
+//peak memory) are written as JSON.
+#ifdef BUILDING_BENCHMARK
+
+struct Benchmark_case{
+    int shape_type;
+    int grid_width;
+    int grid_height;
+    int window_design;
+};
+
+//This writes the parameter file of a case. The building is sized so the tiles stay the same size as
+//the grid grows.
+void write_benchmark_parameters(const Benchmark_case& bench, std::string file_name){
+    std::ofstream out(file_name);
+    int width = std::max(300, bench.grid_width*60);
+    int height = std::max(300, bench.grid_height*50);
+    
+    out << "Shape Type = " << bench.shape_type << "\n";
+    out << "Sides = 6\n";
+    out << "Building Width 1 = " << width << "\nBuilding Length 1 = " << width << "\n";
+    out << "Building Width 2 = " << width << "\nBuilding Length 2 = " << width/2 << "\n";
+    out << "Building Height = " << height << "\n\n";
+    out << "Overhang Width = 30\nOverhang Thickness = 5\nOverhang Height = 20\n\n";
+    
+    const char* rows[3] = {"Bottom", "Centre", "Top"};
+    for(int i = 0; i<3; i++)
+        out << "Window " << rows[i] << " Width Scale = 2\nWindow " << rows[i] << " Height Scale = 2\n";
+    out << "\n";
+    
+    const char* sides[6] = {"Width", "Length", "Side 3", "Side 4", "Side 5", "Side 6"};
+    for(int i = 0; i<3; i++){
+        for(int j = 0; j<6; j++)
+            out << "Grid " << rows[i] << " " << sides[j] << " = " << bench.grid_width << "\n";
+        if(i==0) out << "Bottom Tile Height = 0\n";
+        out << "\n";
+    }
+    out << "Grid Height = " << bench.grid_height << "\n\n";
+    out << "Vertical Offset = 0\n\n";
+    
+    for(int i = 0; i<3; i++)
+        out << "Window " << rows[i] << " Design = " << bench.window_design << "\n";
+    out << "\nDoor Location = 1\nDoor Width Scale = 2\nDoor Height Scale = 1.5\n";
+    out.close();
 }
-//------------------------------MAIN--------------------------
 
-int main(){
-    srand(time(NULL));
+//This clears the stats of the previous case.
+void reset_profile(){
+    std::lock_guard<std::mutex> lock(profile_lock);
+    stage_stats.clear();
+    profile_counters.clear();
+    trace_events.clear();
+    boolean_count = 0;
+}
+
+int main(int argc, char* argv[]){
+    
+    std::string output_file = "benchmark_results.json";
+    int shape_filter = 0; //If set, only cases of this shape type/window design are run.
+    int design_filter = 0;
+    int max_grid_height = 30;
+    std::string calibration_file; //If set, the cost model is fitted to the cases and written here (--calibrate).
+    
+    //The below reads the command line options.
+    for(int i = 1; i<argc; i++){
+        std::string arg = argv[i];
+        if(!arg.compare("--output") && i+1<argc) output_file = argv[++i];
+        else if(!arg.compare("--fast")) fast_backend = true;
+        else if(!arg.compare("--csg")) csg = true;
+        else if(!arg.compare("--eager-transforms")) eager_transforms = true;
+        else if(!arg.compare("--facade-2d")) facade_2d = true;
+        else if(!arg.compare("--instancing")) instancing = true;
+        else if(!arg.compare("--threads") && i+1<argc) thread_count = atoi(argv[++i]);
+        else if(!arg.compare("--shape") && i+1<argc) shape_filter = atoi(argv[++i]);
+        else if(!arg.compare("--design") && i+1<argc) design_filter = atoi(argv[++i]);
+        else if(!arg.compare("--max-grid-height") && i+1<argc) max_grid_height = atoi(argv[++i]);
+        else if(!arg.compare("--snap") && i+1<argc) snap_grid = atof(argv[++i]);
+        else if(!arg.compare("--cost-model") && i+1<argc) read_cost_model(argv[++i]);
+        else if(!arg.compare("--calibrate") && i+1<argc) calibration_file = argv[++i];
+        else if(!arg.compare("--log") && i+1<argc) log_level = parse_log_level(argv[++i]);
+        else std::cout << "Unknown option: " << arg << std::endl;
+    }
+    
     gen_poly();
     gen_cylinder(1, fn);
     
-    Nef_polyhedron nef;
+    if(thread_count==0) thread_count = std::max(1u, std::thread::hardware_concurrency());
+    std::unique_ptr<Task_pool> pool;
+    if(thread_count>1){
+        pool.reset(new Task_pool(thread_count));
+        task_pool = pool.get();
+    }
     
-    nef +=parameter_management(1, "input_parameters.txt");
+    //The output is triangulated glTF, so the face count is the triangle count.
+    profiling = true;
+    mesh_format = "glb";
+    
+    int grids[5][2] = {{2,2}, {4,5}, {6,10}, {8,20}, {10,30}};
+    std::vector<Benchmark_case> cases;
+    for(int shape_type = 1; shape_type<=3; shape_type++)
+        for(int grid = 0; grid<5; grid++)
+            for(int design = 1; design<=5; design++){
+                if((shape_filter && shape_type!=shape_filter) || (design_filter && design!=design_filter) || grids[grid][1]>max_grid_height)
+                    continue;
+                Benchmark_case bench = {shape_type, grids[grid][0], grids[grid][1], design};
+                cases.push_back(bench);
+            }
     
-    //The below converts the nef_polyhedron into a surface mesh to be outputted.
-    Surface_mesh output;
-    CGAL::convert_nef_polyhedron_to_polygon_mesh(nef, output);
-    std::ofstream out;
-    out.open(file_name);
-    out << output;
-    out.close();
+    std::ofstream out(output_file);
+    out << "{\n\"backend\": \"" << (fast_backend ? "fast" : csg ? "csg" : eager_transforms ? "eager" : "exact") << "\", \"threads\": " << thread_count << ", \"instancing\": " << (instancing ? "true" : "false") << ", \"facade_2d\": " << (facade_2d ? "true" : "false") << ", \"snap\": " << snap_grid << ",\n\"cases\": [";
+    
+    //The features and measured values of each case, for --calibrate.
+    std::vector<Cost_vector> features;
+    std::vector<double> booleans, triangles, times;
     
-    std::cout << "Saved file as: " << file_name << std::endl;
+    for(std::size_t i = 0; i<cases.size(); i++){
+        const Benchmark_case& bench = cases[i];
+        std::string parameter_file = "benchmark_parameters_"+std::to_string(i+1)+".txt";
+        write_benchmark_parameters(bench, parameter_file);
+        Cost_estimate estimate = estimate_building(i+1, parameter_file, i+1);
+        
+        reset_profile();
+        Prototype_cache<Nef_polyhedron>::clear();
+        Prototype_cache<Fast_solid>::clear();
+        Prototype_cache<Csg_solid>::clear();
+        Prototype_cache<Lazy_nef>::clear();
+        Prototype_cache<Flat_solid>::clear();
+        
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::string file_name = generate_building(i+1, parameter_file, i+1);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+        
+        std::cout << "Case " << i+1 << "/" << cases.size() << ": shape " << bench.shape_type << ", grid " << bench.grid_width << "x" << bench.grid_height << ", design " << bench.window_design << " in " << seconds << " seconds" << std::endl;
+        
+        std::lock_guard<std::mutex> lock(profile_lock);
+        out << (i ? "," : "") << "\n{\"shape_type\": " << bench.shape_type << ", \"grid_width\": " << bench.grid_width << ", \"grid_height\": " << bench.grid_height
+            << ", \"window_design\": " << bench.window_design << ", \"seed\": " << i+1 << ", \"output\": \"" << file_name << "\",\n"
+            << " \"seconds\": " << seconds << ", \"booleans\": " << boolean_count << ", \"triangles\": " << profile_counters["output triangles"]
+            << ", \"vertices\": " << profile_counters["output vertices"] << ", \"peak_rss_kb\": " << peak_rss() << ",\n"
+            << " \"estimated_seconds\": " << estimate.seconds << ", \"estimated_booleans\": " << estimate.booleans << ", \"estimated_triangles\": " << estimate.triangles << ",\n \"stages\": {";
+        for(std::map<std::string, Stage_stats>::const_iterator it = stage_stats.begin(); it!=stage_stats.end(); ++it){
+            out << (it==stage_stats.begin() ? "" : ", ") << "\"" << it->first << "\": {\"calls\": " << it->second.calls << ", \"seconds\": " << it->second.seconds << ", \"booleans\": " << it->second.booleans << "}";
+        }
+        out << "}}";
+        out.flush();
+        
+        features.push_back(estimate.features);
+        booleans.push_back(boolean_count);
+        triangles.push_back(profile_counters["output triangles"]);
+        times.push_back(seconds);
+    }
+    out << "\n]\n}\n";
+    out.close();
+    std::cout << "Saved results as: " << output_file << std::endl;
+    
+    if(!calibration_file.empty()){
+        fit_cost(features, booleans, cost_model.booleans);
+        fit_cost(features, triangles, cost_model.triangles);
+        fit_cost(features, times, cost_model.seconds);
+        write_cost_model(calibration_file, cases.size());
+        std::cout << "Saved cost model as: " << calibration_file << std::endl;
+    }
     
 }
 
+#else
+
+//------------------------------MAIN--------------------------
+
+int main(int argc, char* argv[]){
+    
+    std::string input_file = "input_parameters.txt";
+    int batch_count = 0; //The amount of buildings to generate from the input file (--batch).
+    std::string batch_list; //A file listing a parameter file for each building (--batch-list).
+    bool threads_set = false;
+    unsigned long long seed = time(NULL); //The seed of the first building, the next ones count up from it (--seed).
+    bool serving = false; //If true, buildings are generated for requests until stopped (--serve).
+    std::string socket_path; //The Unix socket the requests are read from, instead of stdin (--socket).
+    bool estimating = false; //If true, the cost of each building is estimated instead of generating it (--estimate).
+    
+    //On stdin, the server's replies are written to stdout, so everything else (even the messages about
+    //the options below) is printed to stderr.
+    if(std::find(argv+1, argv+argc, std::string("--serve"))!=argv+argc && std::find(argv+1, argv+argc, std::string("--socket"))==argv+argc)
+        std::cout.rdbuf(std::cerr.rdbuf());
+    
+    //The below reads the command line options.
+    for(int i = 1; i<argc; i++){
+        std::string arg = argv[i];
+        if(!arg.compare("--input") && i+1<argc) input_file = argv[++i];
+        else if(!arg.compare("--chain-unions")) chain_unions = true;
+        else if(!arg.compare("--instancing")) instancing = true;
+        else if(!arg.compare("--fast")) fast_backend = true;
+        else if(!arg.compare("--csg")) csg = true;
+        else if(!arg.compare("--eager-transforms")) eager_transforms = true;
+        else if(!arg.compare("--facade-2d")) facade_2d = true;
+        else if(!arg.compare("--lod")) lod_output = true;
+        else if(!arg.compare("--stream")) stream_output = true;
+        else if(!arg.compare("--optimize-mesh")) optimize_mesh = true;
+        else if(!arg.compare("--no-prototype-cache")) prototype_caching = false;
+        else if(!arg.compare("--prototype-cache-size") && i+1<argc) prototype_cache_limit = strtoull(argv[++i], NULL, 10);
+        else if(!arg.compare("--snap") && i+1<argc) snap_grid = atof(argv[++i]);
+        else if(!arg.compare("--mesh-cache") && i+1<argc) mesh_cache_dir = argv[++i];
+        else if(!arg.compare("--mesh-cache-size") && i+1<argc) mesh_cache_limit = atof(argv[++i]);
+        else if(!arg.compare("--estimate")) estimating = true;
+        else if(!arg.compare("--cost-model") && i+1<argc) read_cost_model(argv[++i]);
+        else if(!arg.compare("--triangle-budget") && i+1<argc) triangle_budget = atof(argv[++i]);
+        else if(!arg.compare("--log") && i+1<argc) log_level = parse_log_level(argv[++i]);
+        else if(!arg.compare("--threads") && i+1<argc){
+            thread_count = atoi(argv[++i]);
+            threads_set = true;
+        }
+        else if(!arg.compare("--batch") && i+1<argc) batch_count = atoi(argv[++i]);
+        else if(!arg.compare("--batch-list") && i+1<argc) batch_list = argv[++i];
+        else if(!arg.compare("--serve")) serving = true;
+        else if(!arg.compare("--socket") && i+1<argc){
+            socket_path = argv[++i];
+            serving = true;
+        }
+        else if(!arg.compare("--seed") && i+1<argc) seed = strtoull(argv[++i], NULL, 10);
+        else if(!arg.compare("--profile")) profiling = true;
+        else if(!arg.compare("--trace") && i+1<argc){
+            trace_file = argv[++i];
+            profiling = true;
+        }
+        else if(!arg.compare("--format") && i+1<argc){
+            mesh_format = argv[++i];
+            if(mesh_format.compare("off") && mesh_format.compare("ply") && mesh_format.compare("stl") && mesh_format.compare("glb") && mesh_format.compare("obj")){
+                std::cout << "Unknown format: " << mesh_format << ", using off" << std::endl;
+                mesh_format = "off";
+            }
+        }
+        else std::cout << "Unknown option: " << arg << std::endl;
+    }
+    
+    //The other formats need the counts of the whole mesh before its vertices, so streams are always .OBJ.
+    if(stream_output && mesh_format.compare("obj")){
+        if(mesh_format.compare("off")) std::cout << "--stream writes obj, not " << mesh_format << std::endl;
+        mesh_format = "obj";
+    }
+#if !defined(__unix__) && !defined(__APPLE__)
+    if(!mesh_cache_dir.empty()){
+        std::cout << "The mesh cache is only supported on Unix" << std::endl;
+        mesh_cache_dir.clear();
+    }
+#endif
+    
+    gen_poly();
+    gen_cylinder(1, fn);
+    
+    //Batch and server mode use every core unless the amount of threads is given.
+    if((batch_count>0 || !batch_list.empty() || serving) && !threads_set) thread_count = 0;
+    //On stdin, the server's replies are written to stdout, so nothing else is printed there.
+    if(serving && socket_path.empty()) log_level = LOG_QUIET;
+    if(thread_count==0) thread_count = std::max(1u, std::thread::hardware_concurrency());
+    std::unique_ptr<Task_pool> pool;
+    if(thread_count>1){
+        pool.reset(new Task_pool(thread_count));
+        task_pool = pool.get();
+    }
+    
+    //The generation time is printed at the end, so runs with different options can be compared.
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    
+    //In batch mode, every building is generated as its own task, numbered from 1. The
+    //templates above are only created once and are shared by every building.
+    if(serving) serve(socket_path, seed);
+    else if(estimating){
+        std::vector<std::string> input_files = read_batch_list(batch_list);
+        int count = input_files.empty() ? std::max(batch_count, 1) : input_files.size();
+        for(int num = 1; num<=count; num++){
+            Cost_estimate estimate = estimate_building(num, input_files.empty() ? input_file : input_files[num-1], seed+num-1);
+            Log_line(LOG_SUMMARY) << "Building " << num << ": estimated " << estimate.booleans << " Booleans, " << estimate.triangles << " triangles, " << estimate.seconds << " seconds" << (triangle_budget>0 && estimate.triangles>triangle_budget ? " (over the budget)" : "");
+        }
+        flush_log();
+    }
+    else if(batch_count>0 || !batch_list.empty()){
+        std::vector<std::string> input_files = read_batch_list(batch_list);
+        int count = input_files.empty() ? batch_count : input_files.size();
+        
+        //The buildings are started largest first (by their estimated time), so a slow building isn't
+        //left running alone at the end of the batch.
+        std::vector<std::pair<double, int> > order;
+        for(int num = 1; num<=count; num++)
+            order.push_back(std::make_pair(-estimate_building(num, input_files.empty() ? input_file : input_files[num-1], seed+num-1).seconds, num));
+        std::stable_sort(order.begin(), order.end());
+        
+        Task_group group(task_pool);
+        for(std::size_t i = 0; i<order.size(); i++){
+            int num = order[i].second;
+            group.run([&, num](){
+                try{
+                    generate_building(num, input_files.empty() ? input_file : input_files[num-1], seed+num-1);
+                }
+                catch(std::exception& e){
+                    std::cout << "Building " << num << " failed: " << e.what() << std::endl;
+                }
+            });
+        }
+        group.wait();
+    }
+    else generate_building(1, input_file, seed);
+    
+    //The workers are stopped first, which writes out the rest of their messages.
+    task_pool = NULL;
+    pool.reset();
+    
+    Log_line(LOG_SUMMARY) << "Generated in " << std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count() << " seconds";
+    if(prototype_caching)
+        Log_line(LOG_SUMMARY) << "Prototype cache: " << prototype_cache_hits << " hits, " << prototype_cache_misses << " misses, " << prototype_cache_evictions << " evictions";
+    flush_log();
+    if(profiling) print_profile();
+    if(!trace_file.empty()){
+        write_trace(trace_file);
+        std::cout << "Saved trace as: " << trace_file << std::endl;
+    }
+    
+}
 
+#endif